@@ -0,0 +1,82 @@
+// Benchmark for screen output. Opens a generated C file in a 200x50 screen and
+// times composing whole frames (as after a resize), frames scrolled by one
+// line, and frames where nothing changed. Output goes to /dev/null.
+//
+//   gcc -O2 -pthread -o drawbench bench/drawbench.c
+//   ./drawbench [frames=5000] [file=/tmp/kilo-drawbench.c]
+
+#define KILO_NO_MAIN
+#include "../kilo.c"
+
+#include <sys/time.h>
+
+double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Writes a few thousand long lines mixing every highlight class
+void generate(const char *path) {
+  static const char *words[] = {
+    "int", "while", "return", "count", "buf", "\"str\"", "42", "/* c */",
+    "x", "=", ";", "(", ")", "if", "char", "0x1f", "'c'", "len"
+  };
+  FILE *fp = fopen(path, "w");
+  if (!fp) die("fopen");
+  srand(3);
+  for (int n = 0; n < 4000; n++) {
+    for (int w = 0; w < 50; w++)
+      fprintf(fp, "%s ", words[rand() % (sizeof(words) / sizeof(words[0]))]);
+    fprintf(fp, "// %d\n", n);
+  }
+  fclose(fp);
+}
+
+int main(int argc, char *argv[]) {
+  int frames = argc > 1 ? atoi(argv[1]) : 5000;
+  char *path = argc > 2 ? argv[2] : "/tmp/kilo-drawbench.c";
+
+  generate(path);
+  E.rowroot = rowNodeNew(1);
+  E.hldirty = INT_MAX;
+  E.nthreads = 1;
+  E.screenrows = 50;
+  E.screencols = 200;
+  editorScreenInit();
+  editorOpen(path);
+
+  int null = open("/dev/null", O_WRONLY);
+  int out = dup(STDOUT_FILENO);
+  dup2(null, STDOUT_FILENO);
+  editorRefreshScreen();
+
+  double full = now();
+  long fullbytes = 0;
+  for (int i = 0; i < frames; i++) {
+    E.screenvalid = 0;
+    editorRefreshScreen();
+    fullbytes += E.framebytes;
+  }
+  full = now() - full;
+
+  double scroll = now();
+  long scrollbytes = 0;
+  for (int i = 0; i < frames; i++) {
+    E.cy = E.rowoff + E.screenrows;  // one line past the bottom
+    editorRefreshScreen();
+    scrollbytes += E.framebytes;
+  }
+  scroll = now() - scroll;
+
+  double idle = now();
+  for (int i = 0; i < frames; i++) editorRefreshScreen();
+  idle = now() - idle;
+
+  dup2(out, STDOUT_FILENO);
+  printf("frame     us/frame  bytes/frame\n");
+  printf("full      %8.1f  %11ld\n", full / frames * 1e6, fullbytes / frames);
+  printf("scroll    %8.1f  %11ld\n", scroll / frames * 1e6, scrollbytes / frames);
+  printf("idle      %8.1f  %11ld\n", idle / frames * 1e6, E.framebytes);
+  return 0;
+}
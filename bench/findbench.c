@@ -0,0 +1,144 @@
+// Benchmark for whole-file search. Generates a large log file, opens it the
+// way the editor does, then times a search for a string that isn't there (the
+// worst case, every byte is looked at) and for a rare one. The reference is
+// the search kilo used to do: strstr on each row's text in turn. The editor's
+// own search runs with 1 up to N threads and is checked to find the same rows,
+// then once more ignoring case. Patterns are timed the same way, against
+// POSIX regexec on each row of the first 200000.
+//
+//   gcc -O2 -pthread -o findbench bench/findbench.c
+//   ./findbench [megabytes=500] [max threads=cores] [file=/tmp/kilo-findbench.log]
+
+#define KILO_NO_MAIN
+#include "../kilo.c"
+
+#include <sys/time.h>
+#include <regex.h>
+
+double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Writes about `mb` megabytes of log lines, one in 100000 naming a failed job
+void generate(const char *path, long mb) {
+  static const char *level[] = {"INFO", "DEBUG", "WARN", "INFO", "TRACE"};
+  struct stat st;
+  if (stat(path, &st) == 0 && st.st_size >= mb << 20) return;
+  FILE *fp = fopen(path, "w");
+  if (!fp) die("fopen");
+  long written = 0;
+  for (long n = 0; written < mb << 20; n++) {
+    written += fprintf(fp, "2025-03-%02ld 12:%02ld:%02ld.%03ld %-5s [worker-%ld] request id=%08lx took %ldms path=/api/v2/items/%ld\n",
+      n % 28 + 1, n / 60 % 60, n % 60, n % 1000, level[n % 5], n % 16, n * 2654435761u, n % 997, n % 100003);
+    if (n % 100000 == 99999)
+      written += fprintf(fp, "2025-03-01 00:00:00.000 ERROR [worker-0] job %ld failed: disk quota exceeded\n", n);
+  }
+  fclose(fp);
+}
+
+// The old search: each row's text, null-terminated, through strstr
+int strstrSearch(const char *q) {
+  int found = 0;
+  char *line = malloc(1);
+  int cap = 1;
+  for (int i = 0; i < E.numrows; i++) {
+    off_t start = E.lineoff[i];
+    int len = E.lineoff[i + 1] - 1 - start;
+    if (len + 1 > cap) {
+      cap = len + 1;
+      line = realloc(line, cap);
+    }
+    memcpy(line, &E.map[start], len);
+    line[len] = '\0';
+    if (strstr(line, q)) found++;
+  }
+  free(line);
+  return found;
+}
+
+// The editor's search over every row, in seconds
+double search(const char *q, int icase, struct regex *re, int *found) {
+  struct findLevel lv = {0};
+  double start = now();
+  editorFindLevel(&lv, NULL, q, strlen(q), icase, re);
+  double secs = now() - start;
+  *found = lv.n;
+  free(lv.rows);
+  free(lv.cols);
+  return secs;
+}
+
+void run(const char *q, int maxthreads) {
+  double gb = E.mapsize / 1e9;
+  double start = now();
+  int expect = strstrSearch(q);
+  double ref = now() - start;
+  printf("\"%s\": %d rows\n", q, expect);
+  printf("  strstr loop        %6.3f s  %5.2f GB/s\n", ref, gb / ref);
+  int found;
+  for (int t = 1;; t = (t * 2 < maxthreads) ? t * 2 : maxthreads) {
+    E.nthreads = t;
+    double secs = search(q, 0, NULL, &found);
+    printf("  search, %2d thread%s %6.3f s  %5.2f GB/s  %s\n", t, t == 1 ? " " : "s",
+      secs, gb / secs, found == expect ? "" : "WRONG MATCH COUNT");
+    if (t == maxthreads) break;
+  }
+  double secs = search(q, 1, NULL, &found);
+  printf("  ignoring case      %6.3f s  %5.2f GB/s  %d rows\n", secs, gb / secs, found);
+}
+
+void runRegex(const char *pattern, int maxthreads) {
+  const char *err;
+  struct regex *re = regexCompile(pattern, strlen(pattern), 0, &err);
+  regex_t px;
+  regcomp(&px, pattern, REG_EXTENDED | REG_NOSUB);
+  int rows = E.numrows < 200000 ? E.numrows : 200000;
+  char *line = malloc(1);
+  int cap = 1, expect = 0;
+  double start = now();
+  for (int i = 0; i < rows; i++) {
+    int len = E.lineoff[i + 1] - 1 - E.lineoff[i];
+    if (len + 1 > cap) line = realloc(line, cap = len + 1);
+    memcpy(line, &E.map[E.lineoff[i]], len);
+    line[len] = '\0';
+    if (regexec(&px, line, 0, NULL, 0) == 0) expect++;
+  }
+  double ref = now() - start;
+  free(line);
+  regfree(&px);
+  printf("/%s/: literal \"%.*s\"\n", pattern, re->litlen, re->lit);
+  printf("  regexec, %d rows %6.3f s  %5.2f GB/s  %d rows\n", rows, ref,
+    (E.lineoff[rows] - E.lineoff[0]) / 1e9 / ref, expect);
+  for (int t = 1;; t = (t * 2 < maxthreads) ? t * 2 : maxthreads) {
+    E.nthreads = t;
+    int found;
+    double secs = search(pattern, 0, re, &found);
+    printf("  search, %2d thread%s %6.3f s  %5.2f GB/s  %d rows\n", t, t == 1 ? " " : "s",
+      secs, E.mapsize / 1e9 / secs, found);
+    if (t == maxthreads) break;
+  }
+  regexFree(re);
+}
+
+int main(int argc, char *argv[]) {
+  long mb = argc > 1 ? atol(argv[1]) : 500;
+  int maxthreads = argc > 2 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+  char *path = argc > 3 ? argv[3] : "/tmp/kilo-findbench.log";
+
+  generate(path, mb);
+  E.rowroot = rowNodeNew(1);
+  E.hldirty = INT_MAX;
+  E.nthreads = 1;
+  editorScanSelect();
+  editorOpen(path);
+  printf("%s: %ld MB, %d rows\n", path, (long)(E.mapsize >> 20), E.numrows);
+  strstrSearch("");  // untimed pass so every run finds the file in the page cache
+
+  run("segmentation fault", maxthreads);
+  run("disk quota", maxthreads);
+  runRegex("ERROR .* job [0-9]+ failed", maxthreads);
+  runRegex("id=[0-9a-f]{8} took [0-9]ms", maxthreads);
+  return 0;
+}
@@ -0,0 +1,68 @@
+// Benchmark for the parallel comment-state walk. Generates a large C file,
+// opens it the way the editor does, then times the walk over every row (what
+// the first jump to the end of the file costs) with 1 up to N threads.
+//
+//   gcc -O2 -pthread -o hlbench bench/hlbench.c
+//   ./hlbench [megabytes=500] [max threads=cores] [file=/tmp/kilo-hlbench.c]
+
+#define KILO_NO_MAIN
+#include "../kilo.c"
+
+#include <sys/time.h>
+
+double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Writes about `mb` megabytes of generated C, with a block comment every few
+// hundred lines and comment openers inside strings to keep the scan honest
+void generate(const char *path, long mb) {
+  struct stat st;
+  if (stat(path, &st) == 0 && st.st_size >= mb << 20) return;
+  FILE *fp = fopen(path, "w");
+  if (!fp) die("fopen");
+  long written = 0;
+  for (long n = 0; written < mb << 20; n++) {
+    if (n % 397 == 0)
+      written += fprintf(fp, "/* table %ld\n * generated, do not edit\n */\n", n);
+    else if (n % 7 == 0)
+      written += fprintf(fp, "  { \"/* entry %ld\", %ld, 0x%lx }, // row\n", n, n * 31, n);
+    else
+      written += fprintf(fp, "static int v%ld = %ld + sizeof(long) * %ld;\n", n, n, n % 13);
+  }
+  fclose(fp);
+}
+
+int main(int argc, char *argv[]) {
+  long mb = argc > 1 ? atol(argv[1]) : 500;
+  int maxthreads = argc > 2 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+  char *path = argc > 3 ? argv[3] : "/tmp/kilo-hlbench.c";
+
+  generate(path, mb);
+  E.rowroot = rowNodeNew(1);
+  E.hldirty = INT_MAX;
+  E.nthreads = 1;
+  editorOpen(path);
+  printf("%s: %ld MB, %d rows\n", path, (long)(E.mapsize >> 20), E.numrows);
+
+  // Untimed pass so every run finds the file in the page cache
+  editorSyntaxStateAt(E.numrows - 1);
+  int expect = editorSyntaxStateAt(E.numrows - 1);
+
+  printf("threads  seconds  speedup  MB/s\n");
+  double base = 0;
+  for (int t = 1;; t = (t * 2 < maxthreads) ? t * 2 : maxthreads) {
+    E.nthreads = t;
+    editorSelectSyntaxHighlight();  // forget all checkpoints
+    double start = now();
+    int state = editorSyntaxStateAt(E.numrows - 1);
+    double secs = now() - start;
+    if (t == 1) base = secs;
+    printf("%7d  %7.3f  %6.2fx  %4.0f%s\n", t, secs, base / secs,
+           (E.mapsize >> 20) / secs, state == expect ? "" : "  WRONG STATE");
+    if (t >= maxthreads) break;
+  }
+  return 0;
+}
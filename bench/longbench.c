@@ -0,0 +1,128 @@
+// Long-line mode. A C file is generated whose middle line is one very long
+// statement of minified code, with strings, comments and tabs in it, and the
+// line is opened and edited twice: as a long row, rendered and highlighted a
+// window of columns at a time, and as an ordinary row, rendered and
+// highlighted whole (long-line mode off). For each it times:
+//
+//   open          editorOpen and the first frame with the cursor at the
+//                 line's start
+//   scroll        frames with the cursor jumping to random columns of the line
+//   pan           frames with the cursor moving right a screen at a time
+//   type          editorInsertChar of a statement in the middle of the line,
+//                 a key at a time, and the frame after each key
+//
+// and reports the bytes the line's render and hl take. The frames of both are
+// checksummed, which must agree.
+//
+//   gcc -O2 -pthread -o longbench bench/longbench.c
+//   ./longbench [line=67108864] [file=/tmp/kilo-longbench.c]
+
+#define KILO_NO_MAIN
+#include "../kilo.c"
+
+#include <sys/wait.h>
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Writes a few hundred lines of C around a line of about line bytes
+void generate(const char *path, long line) {
+  static const char *parts[] = {
+    "a=b+c;", "if(x>42){y--;}", "s=\"a, \\\"quoted\\\" string\";", "/* note */",
+    "t[i]=0x1f;", "\tk='c';", "for(i=0;i<n;i++)f(i);", "while(p)p=p->next;"
+  };
+  FILE *fp = fopen(path, "w");
+  if (!fp) die("fopen");
+  srand(9);
+  for (int y = 0; y < 400; y++) {
+    if (y == 200) {
+      for (long written = 0; written < line;) written += fprintf(fp, "%s", parts[rand() % 8]);
+      fprintf(fp, "\n");
+    }
+    fprintf(fp, "\tint v%d = table[%d];  // line %d\n", y, y % 31, y);
+  }
+  fclose(fp);
+}
+
+uint64_t sum;  // FNV-1a checksum of the frames
+
+void sumFrame(const char *buf, int len) {
+  for (int i = 0; i < len; i++) sum = (sum ^ (unsigned char)buf[i]) * 1099511628211u;
+}
+
+void result(const char *what, const char *mode, long ops, double secs) {
+  printf("%-8s %-7s %7ld %12.1f\n", what, mode, ops, secs / ops * 1e6);
+  fflush(stdout);
+}
+
+// Draws a frame with the cursor at column cx of row cy
+void frameAt(int cy, int cx) {
+  E.cy = cy;
+  E.cx = cx;
+  editorScroll();
+  editorRefreshScreen();
+}
+
+// Runs every kernel with rows of at least longline bytes as long rows;
+// forked, so each mode starts from a fresh editor
+void run(const char *path, const char *mode, int longline) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == -1) die("fork");
+  if (pid == 0) {
+    static struct replayIO io = {NULL, sumFrame, 52, 200};
+    replay = &io;
+    initEditor();
+    E.longline = longline;
+    double start = now();
+    editorOpen((char *)path);
+    frameAt(200, 0);
+    result("open", mode, 1, now() - start);
+    erow *row = editorRowAt(200);
+
+    srand(11);
+    start = now();
+    for (int i = 0; i < 200; i++) frameAt(200, rand() % row->size);
+    result("scroll", mode, 200, now() - start);
+
+    int n = 0;
+    start = now();
+    for (int cx = 0; cx < row->size && n < 20000; cx += E.screencols, n++) frameAt(200, cx);
+    result("pan", mode, n, now() - start);
+
+    frameAt(200, row->size / 2);
+    start = now();
+    for (int i = 0; i < 100; i++) {
+      editorInsertChar(" x = y + 1;"[i % 11]);
+      editorScroll();
+      editorRefreshScreen();
+    }
+    result("type", mode, 100, now() - start);
+
+    long bytes = (row->render != row->chars ? row->rcap : 0) + row->hlcap;
+    if (row->tabs && row->tabs->win) bytes += sizeof(struct rowCheck) * row->tabs->win->chkcap;
+    printf("%-8s %-7s render and hl of the line: %ld bytes; frames %016llx\n", "memory", mode,
+      bytes, (unsigned long long)sum);
+    fflush(stdout);
+    exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  long line = argc > 1 ? atol(argv[1]) : 64 << 20;
+  char *path = argc > 2 ? argv[2] : "/tmp/kilo-longbench.c";
+
+  generate(path, line);
+  printf("%s: a line of %ld bytes\n", path, line);
+  printf("kernel   mode        ops        us/op\n");
+  run(path, "window", ROW_LONG_LINE);
+  run(path, "whole", INT_MAX);
+  unlink(path);
+  return 0;
+}
@@ -0,0 +1,197 @@
+// Micro-benchmarks for the editor's hot kernels, written out as JSON so runs
+// can be compared from one commit to the next (`make bench` saves them as
+// bench-<commit>.json). Each kernel runs on four generated C files, one for
+// each kind of input that stresses it: tab-heavy, long lines, comment-heavy
+// and keyword-dense. The kernels:
+//
+//   update_row     editorUpdateRow on every row (tab expansion)
+//   update_syntax  editorUpdateSyntax on every row, carrying comment state
+//   cx_to_rx       editorRowCxToRx of the last character of every row
+//   rx_to_cx       editorRowRxToCx from the end of every row
+//   draw_frame     editorRefreshScreen from scratch (editorDrawRows, abAppend)
+//                  on screens down the file
+//   write_rows     editorWriteRows of the whole file into a memfd
+//   find           editorFindLevel for a string found nowhere, on one thread
+//
+// Every kernel is repeated for at least 0.2 s; the figures are per operation
+// (a row, a frame or a whole pass) and per byte of the text it went over.
+//
+//   gcc -O2 -pthread -o microbench bench/microbench.c
+//   ./microbench > bench.json
+
+#define KILO_NO_MAIN
+#include "../kilo.c"
+
+#include <sys/wait.h>
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *inputs[] = {"tab-heavy", "long-line", "comment-heavy", "keyword-dense"};
+
+// Writes the input called name, about 4 MB of it, to path
+void generate(const char *name, const char *path) {
+  static const char *kw[] = {
+    "int", "char", "return", "while", "for", "if", "static", "unsigned", "struct",
+    "switch", "case", "break", "long", "void", "else", "typedef"
+  };
+  FILE *fp = fopen(path, "w");
+  if (!fp) die("fopen");
+  srand(7);
+  long written = 0;
+  for (int n = 0; written < 4 << 20; n++) {
+    if (strcmp(name, "tab-heavy") == 0) {
+      written += fprintf(fp, "\t\t\tv%d\t=\ttable[%d];\t\t// %d\t%d\n", n % 97, n % 31, n, n * 7);
+    } else if (strcmp(name, "long-line") == 0) {
+      for (int w = 0; w < 500; w++) written += fprintf(fp, "%s x%d = %d; ", kw[rand() % 16], w, n);
+      written += fprintf(fp, "\n");
+    } else if (strcmp(name, "comment-heavy") == 0) {
+      if (n % 6 == 0) written += fprintf(fp, "/* block %d opens here\n", n);
+      else if (n % 6 == 3) written += fprintf(fp, "   and closes */ x = \"str /* %d\"; // tail\n", n);
+      else written += fprintf(fp, "  // comment %d with \"quotes\" and 'c' and /* nested\n", n);
+    } else {
+      for (int w = 0; w < 8; w++) written += fprintf(fp, "%s ", kw[rand() % 16]);
+      written += fprintf(fp, "x%d = %d;\n", n, n % 1000);
+    }
+  }
+  fclose(fp);
+}
+
+void discardFrame(const char *buf, int len) {
+  (void)buf;
+  (void)len;
+}
+
+int entries;  // Results printed so far, for the commas between them
+
+// Prints one result: `ops` operations over `bytes` bytes took `secs`
+void result(const char *kernel, const char *input, long ops, double bytes, double secs) {
+  printf("%s    {\"kernel\": \"%s\", \"input\": \"%s\", \"ops\": %ld, \"ns_per_op\": %.1f, \"mb_per_s\": %.1f}",
+    entries++ ? ",\n" : "", kernel, input, ops, secs / ops * 1e9, bytes / secs / 1e6);
+}
+
+long textBytes(void) {
+  long bytes = 0;
+  for (int i = 0; i < E.numrows; i++) bytes += editorRowPeek(i)->size + 1;
+  return bytes;
+}
+
+// Repeats pass until it has run for 0.2 s; returns the seconds per pass
+double timePasses(void (*pass)(void)) {
+  double start = now(), secs;
+  long passes = 0;
+  do {
+    pass();
+    passes++;
+    secs = now() - start;
+  } while (secs < 0.2);
+  return secs / passes;
+}
+
+void passUpdateRow(void) {
+  for (int i = 0; i < E.numrows; i++) editorUpdateRow(editorRowAt(i));
+}
+
+void passUpdateSyntax(void) {
+  int in = 0;
+  for (int i = 0; i < E.numrows; i++) {
+    erow *row = editorRowAt(i);
+    editorUpdateSyntax(row, in);
+    in = row->hl_open_comment;
+  }
+}
+
+volatile int sink;
+
+void passCxToRx(void) {
+  for (int i = 0; i < E.numrows; i++) {
+    erow *row = editorRowAt(i);
+    sink = editorRowCxToRx(row, row->size ? row->size - 1 : 0);  // short of the gap
+  }
+}
+
+void passRxToCx(void) {
+  for (int i = 0; i < E.numrows; i++) {
+    erow *row = editorRowAt(i);
+    sink = editorRowRxToCx(row, row->rsize);
+  }
+}
+
+int frames;  // Frames drawn by one pass
+
+void passDraw(void) {
+  frames = 0;
+  for (int y = 0; y < E.numrows; y += E.numrows / 20 + 1, frames++) {
+    E.cy = y;
+    E.rowoff = y;
+    E.screenvalid = 0;
+    editorRefreshScreen();
+  }
+}
+
+int memfd;
+
+void passWrite(void) {
+  lseek(memfd, 0, SEEK_SET);
+  if (editorWriteRows(memfd) == -1) die("editorWriteRows");
+}
+
+void passFind(void) {
+  struct findLevel lv = {0};
+  editorFindLevel(&lv, NULL, "segmentation fault", 18, 0, NULL);
+  free(lv.rows);
+  free(lv.cols);
+}
+
+// Runs every kernel on one input; forked, so each starts from a fresh editor
+void run(const char *input) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/kilo-microbench-%s.c", input);
+  generate(input, path);
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == -1) die("fork");
+  if (pid == 0) {
+    static struct replayIO io = {NULL, discardFrame, 52, 200};
+    replay = &io;
+    initEditor();
+    E.nthreads = 1;
+    editorOpen(path);
+    for (int i = 0; i < E.numrows; i++) editorRowAt(i);
+    memfd = memfd_create("microbench", 0);
+    if (memfd == -1) die("memfd_create");
+
+    long bytes = textBytes();
+    double secs = timePasses(passUpdateRow);
+    result("update_row", input, E.numrows, bytes, secs);
+    secs = timePasses(passUpdateSyntax);
+    result("update_syntax", input, E.numrows, bytes, secs);
+    secs = timePasses(passCxToRx);
+    result("cx_to_rx", input, E.numrows, bytes, secs);
+    secs = timePasses(passRxToCx);
+    result("rx_to_cx", input, E.numrows, bytes, secs);
+    secs = timePasses(passDraw);
+    result("draw_frame", input, frames, (double)frames * E.screenrows * E.screencols, secs);
+    secs = timePasses(passWrite);
+    result("write_rows", input, 1, bytes, secs);
+    secs = timePasses(passFind);
+    result("find", input, 1, bytes, secs);
+    fflush(stdout);
+    exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) exit(1);
+  entries += 7;
+  unlink(path);
+}
+
+int main(void) {
+  printf("{\n  \"results\": [\n");
+  for (size_t k = 0; k < sizeof(inputs) / sizeof(inputs[0]); k++) run(inputs[k]);
+  printf("\n  ]\n}\n");
+  return 0;
+}
@@ -0,0 +1,245 @@
+// Headless benchmark: replays keystrokes into the editor with a virtual
+// terminal standing in for the real one. A generated C file is opened in a
+// screen of the given size and a script of keys is fed to the editor one key
+// at a time, as if typed: each key is handled and its frame drawn before the
+// next is read. Frames are checksummed and thrown away. For each workload it
+// reports the keys' latencies (from reading a key to the frame after it) as
+// p50/p99/max, the bytes the frames took and their checksum, which only
+// changes when what the screen shows does.
+//
+// The workloads are built in (typing, paste, scroll, search), or a script is
+// read from a file of raw terminal input, such as one recorded with
+//   KILO_RECORD=keys.txt ./kilo file.c
+//
+//   gcc -O2 -pthread -o replaybench bench/replaybench.c
+//   ./replaybench [workload=all|typing|paste|scroll|search|script file] [rows=50] [cols=200] [file=/tmp/kilo-replaybench.c]
+
+#define KILO_NO_MAIN
+#include "../kilo.c"
+
+#include <sys/wait.h>
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Writes some 135000 lines of C: functions of indented statements and comments
+void generate(const char *path) {
+  static const char *words[] = {
+    "count", "buf", "len", "table[i]", "42", "0x1f", "'c'", "\"str\"", "next", "size"
+  };
+  struct stat st;
+  if (stat(path, &st) == 0) return;
+  FILE *fp = fopen(path, "w");
+  if (!fp) die("fopen");
+  srand(5);
+  for (int n = 0; n < 100000; n++) {
+    if (n % 20 == 0) fprintf(fp, "/* function %d */\nint f%d(int x) {\n", n / 20, n / 20);
+    else if (n % 20 == 19) fprintf(fp, "\treturn %s;\n}\n", words[rand() % 10]);
+    else if (n % 7 == 0) fprintf(fp, "\tif (%s > %s) {\n\t\t%s++;  // %d\n\t}\n",
+      words[rand() % 10], words[rand() % 10], words[rand() % 10], n);
+    else fprintf(fp, "\t%s = %s * %s + x;\n", words[rand() % 4], words[rand() % 10], words[rand() % 10]);
+  }
+  fclose(fp);
+}
+
+// The script being replayed: raw input, handed out a key at a time
+struct {
+  char *b;
+  long len;
+  long cap;
+  long pos;             // Next byte to hand out
+  long end;             // End of the key being read
+  double start;         // When the key being read was handed out
+  double *lat;          // Latency of each key so far, in seconds
+  long nkeys;
+  long bytes;           // Bytes of all frames
+  uint64_t sum;         // FNV-1a checksum of all frames
+  const char *name;
+} script;
+
+void add(const char *s, long len) {
+  if (script.len + len > script.cap) {
+    script.cap = (script.len + len) * 2;
+    script.b = realloc(script.b, script.cap);
+  }
+  memcpy(&script.b[script.len], s, len);
+  script.len += len;
+}
+
+void addStr(const char *s) {
+  add(s, strlen(s));
+}
+
+void addKey(const char *key, int times) {
+  while (times--) addStr(key);
+}
+
+// Bytes of the key starting at s: an escape sequence, a whole bracketed
+// paste, or a single byte
+long keyLength(const char *s, long len) {
+  if (s[0] != '\x1b' || len < 2) return 1;
+  if (len >= 6 && memcmp(s, "\x1b[200~", 6) == 0) {
+    char *end = memmem(s, len, "\x1b[201~", 6);
+    return end ? end + 6 - s : len;
+  }
+  if (s[1] != '[' && s[1] != 'O') return 1;
+  long i = 2;
+  while (i < len && ((s[i] >= '0' && s[i] <= '9') || s[i] == ';')) i++;
+  return (i < len) ? i + 1 : len;
+}
+
+int cmpDouble(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+void report(void) {
+  qsort(script.lat, script.nkeys, sizeof(double), cmpDouble);
+  long n = script.nkeys ? script.nkeys : 1;
+  printf("%-10s %7ld %9.1f %9.1f %9.1f %11ld  %016llx\n", script.name, script.nkeys,
+    script.lat[n / 2] * 1e6, script.lat[n * 99 / 100] * 1e6, script.lat[n - 1] * 1e6,
+    script.bytes, (unsigned long long)script.sum);
+  fflush(stdout);
+}
+
+int replayRead(char *buf, int len, int next) {
+  if (next && script.pos == script.end) {
+    double t = now();
+    if (script.start) script.lat[script.nkeys++] = t - script.start;
+    if (script.pos == script.len) {
+      report();
+      exit(0);
+    }
+    script.end = script.pos + keyLength(&script.b[script.pos], script.len - script.pos);
+    script.start = t;
+  }
+  long n = script.end - script.pos;
+  if (n > len) n = len;
+  memcpy(buf, &script.b[script.pos], n);
+  script.pos += n;
+  return n;
+}
+
+void replayFrame(const char *buf, int len) {
+  for (int i = 0; i < len; i++) script.sum = (script.sum ^ (unsigned char)buf[i]) * 1099511628211u;
+  script.bytes += len;
+}
+
+// Types a few hundred lines of code into the middle of the file, with typos
+// taken back, and a Home/End now and then
+void typing(void) {
+  static const char *line = "\tcount = table[i] * 42 + x;  // running total";
+  addKey("\x1b[B", 100);
+  addKey("\x1b[F", 1);
+  for (int n = 0; n < 300; n++) {
+    addStr("\r");
+    for (int i = 0; line[i]; i++) {
+      add(&line[i], 1);
+      if ((n + i) % 37 == 0) addStr("xy\x7f\x7f");
+    }
+    if (n % 10 == 0) addStr("\x1b[H\x1b[F");
+  }
+}
+
+// Pastes blocks of 200 lines into the file at different places
+void paste(void) {
+  for (int n = 0; n < 50; n++) {
+    addKey("\x1b[6~", 3);
+    addStr("\x1b[200~");
+    for (int i = 0; i < 200; i++) {
+      char buf[80];
+      snprintf(buf, sizeof(buf), "\tv%d = table[%d] + %d;  /* pasted */\n", i, n, i * n);
+      addStr(buf);
+    }
+    addStr("\x1b[201~");
+  }
+}
+
+// Pages down through the file, moves down a line at a time, then pages up
+// with some sideways moves
+void scroll(void) {
+  addKey("\x1b[6~", 500);
+  addKey("\x1b[B", 3000);
+  for (int n = 0; n < 500; n++) {
+    addStr("\x1b[5~");
+    addKey("\x1b[C", 5);
+  }
+}
+
+// Searches for words as they are typed, stepping through the matches and
+// switching case and regex mode on the way
+void search(void) {
+  static const char *query[] = {"table", "running", "count = buf", "function 4", "zzz", "0x1f"};
+  for (int n = 0; n < 30; n++) {
+    addStr("\x19");
+    addStr(query[n % 6]);
+    addKey("\x1b[B", 20);
+    if (n % 3 == 1) addStr("\x14");
+    if (n % 5 == 2) addStr("\x12");
+    addKey("\x1b[A", 5);
+    addStr(n % 2 ? "\r" : "\x1b");
+  }
+}
+
+void run(const char *name, int rows, int cols, const char *path) {
+  script.len = 0;
+  script.name = name;
+  if (strcmp(name, "typing") == 0) typing();
+  else if (strcmp(name, "paste") == 0) paste();
+  else if (strcmp(name, "scroll") == 0) scroll();
+  else if (strcmp(name, "search") == 0) search();
+  else {
+    FILE *fp = fopen(name, "r");
+    if (!fp) die(name);
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) add(buf, n);
+    fclose(fp);
+    // a recorded session ends in Ctrl-X, which would quit before the report
+    while (script.len > 0 && script.b[script.len - 1] == CTRL_KEY('x')) script.len--;
+  }
+  script.lat = malloc(sizeof(double) * (script.len + 1));
+
+  // each workload starts from the same file, in a process of its own
+  pid_t pid = fork();
+  if (pid == -1) die("fork");
+  if (pid == 0) {
+    static struct replayIO io = {replayRead, replayFrame, 0, 0};
+    io.rows = rows;
+    io.cols = cols;
+    replay = &io;
+    initEditor();
+    editorOpen((char *)path);
+    while (1) {
+      editorScroll();
+      editorProcessKeypress();
+      E.redraw = 1;
+    }
+  }
+  waitpid(pid, NULL, 0);
+  free(script.lat);
+}
+
+int main(int argc, char *argv[]) {
+  char *workload = argc > 1 ? argv[1] : "all";
+  int rows = argc > 2 ? atoi(argv[2]) : 50;
+  int cols = argc > 3 ? atoi(argv[3]) : 200;
+  char *path = argc > 4 ? argv[4] : "/tmp/kilo-replaybench.c";
+
+  generate(path);
+  printf("%s in %dx%d\n", path, rows, cols);
+  printf("workload      keys    p50 us    p99 us    max us  frame bytes  checksum\n");
+  fflush(stdout);
+  if (strcmp(workload, "all") == 0) {
+    run("typing", rows, cols, path);
+    run("paste", rows, cols, path);
+    run("scroll", rows, cols, path);
+    run("search", rows, cols, path);
+  } else {
+    run(workload, rows, cols, path);
+  }
+  return 0;
+}
@@ -0,0 +1,153 @@
+// Benchmark for row memory. Generates a file of short lines, opens it the way
+// the editor does, then loads every row (chars, render and hl), types a few
+// characters into every 16th row so buffers grow, and frees it all again. The
+// reference is the way kilo used to do it: three malloc()s for each row, with
+// a full render copy and one hl byte per column, realloc() to grow and one
+// free() per block. Both are timed, with the memory the process gained
+// (resident set) while the rows were loaded; the editor's rows are highlighted
+// before it is measured, as they would be once drawn. The editor's load also
+// sets up the row's gap and render bookkeeping, so it does a little more than
+// the reference. With 0 lines the file is used as it is, e.g. a source tree
+// concatenated into one .c file.
+//
+//   gcc -O2 -pthread -o rowbench bench/rowbench.c
+//   ./rowbench [million lines=2] [file=/tmp/kilo-rowbench.c]
+
+#define KILO_NO_MAIN
+#include "../kilo.c"
+
+#include <sys/time.h>
+#include <malloc.h>
+
+double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Resident memory of the process, in megabytes
+long residentMB(void) {
+  long pages = 0;
+  FILE *fp = fopen("/proc/self/statm", "r");
+  if (fp) {
+    if (fscanf(fp, "%*s %ld", &pages) != 1) pages = 0;
+    fclose(fp);
+  }
+  return pages * sysconf(_SC_PAGESIZE) >> 20;
+}
+
+// Writes `lines` lines of generated C, short ones and indented ones with tabs
+void generate(const char *path, long lines) {
+  FILE *fp = fopen(path, "w");
+  if (!fp) die("fopen");
+  for (long n = 0; n < lines; n++) {
+    if (n % 5 == 0) fprintf(fp, "}\n");
+    else if (n % 5 == 1) fprintf(fp, "\tif (x%ld > %ld) {\n", n % 97, n);
+    else fprintf(fp, "\t\tv%ld = table[%ld] * %ld; // entry %ld\n", n % 13, n % 1000, n % 7, n);
+  }
+  fclose(fp);
+}
+
+// The old way: a row's three blocks each from malloc
+struct oldRow {
+  char *chars;
+  char *render;
+  unsigned char *hl;
+  int size;
+};
+
+void runMalloc(long *mb, double *load, double *edit, double *teardown) {
+  struct oldRow *rows = malloc(sizeof(struct oldRow) * E.numrows);
+  long before = residentMB();
+  double start = now();
+  for (int i = 0; i < E.numrows; i++) {
+    erow *row = editorRowPeek(i);
+    char *s = editorRowData(row);
+    struct oldRow *r = &rows[i];
+    r->size = row->size;
+    r->chars = malloc(row->size + 1);
+    memcpy(r->chars, s, row->size);
+    r->chars[row->size] = '\0';
+    int tabs = 0;
+    for (int j = 0; j < row->size; j++)
+      if (s[j] == '\t') tabs++;
+    int rcap = row->size + tabs * (KILO_TAB_STOP - 1) + 1;
+    r->render = malloc(rcap);
+    r->hl = realloc(NULL, rcap);
+    int idx = 0;
+    for (int j = 0; j < row->size; j++) {
+      if (s[j] == '\t') {
+        r->render[idx++] = ' ';
+        while (idx % KILO_TAB_STOP != 0) r->render[idx++] = ' ';
+      } else {
+        r->render[idx++] = s[j];
+      }
+    }
+    r->render[idx] = '\0';
+    memset(r->hl, HL_NORMAL, idx);
+  }
+  *load = now() - start;
+  start = now();
+  for (int i = 0; i < E.numrows; i += 16) {
+    struct oldRow *r = &rows[i];
+    for (int k = 0; k < 8; k++) {
+      r->size++;
+      r->chars = realloc(r->chars, r->size + 1);
+      r->render = realloc(r->render, r->size * KILO_TAB_STOP + 1);
+      r->hl = realloc(r->hl, r->size * KILO_TAB_STOP + 1);
+    }
+  }
+  *edit = now() - start;
+  *mb = residentMB() - before;
+  start = now();
+  for (int i = 0; i < E.numrows; i++) {
+    free(rows[i].chars);
+    free(rows[i].render);
+    free(rows[i].hl);
+  }
+  *teardown = now() - start;
+  free(rows);
+}
+
+void runArena(long *mb, double *load, double *edit, double *teardown) {
+  malloc_trim(0);  // hand back what the reference freed, so it isn't reused unseen
+  long before = residentMB();
+  double start = now();
+  for (int i = 0; i < E.numrows; i++) editorRowAt(i);
+  *load = now() - start;
+  start = now();
+  for (int i = 0; i < E.numrows; i += 16)
+    for (int k = 0; k < 8; k++) editorRowInsertChar(i, 0, 'x');
+  *edit = now() - start;
+  int st = 0;
+  for (int i = 0; i < E.numrows; i++) st = editorRowHighlight(editorRowAt(i), st);
+  *mb = residentMB() - before;
+  char stats[120];
+  rowArenaStats(stats, sizeof(stats));
+  printf("%s\n", stats);
+  start = now();
+  rowArenaRelease();
+  *teardown = now() - start;
+}
+
+int main(int argc, char *argv[]) {
+  long lines = (long)((argc > 1 ? atof(argv[1]) : 2) * 1000000);
+  char *path = argc > 2 ? argv[2] : "/tmp/kilo-rowbench.c";
+
+  if (lines > 0) generate(path, lines);
+  E.rowroot = rowNodeNew(1);
+  E.hldirty = INT_MAX;
+  E.nthreads = 1;
+  editorOpen(path);
+  printf("%s: %ld MB, %d rows\n", path, (long)(E.mapsize >> 20), E.numrows);
+  for (int i = 0; i < E.numrows; i += ROW_LEAF_MAX) editorRowPeek(i);  // the tree's own memory, up front
+
+  long mb;
+  double load, edit, teardown;
+  runMalloc(&mb, &load, &edit, &teardown);
+  printf("               load     edit  teardown  memory\n");
+  printf("malloc       %6.3f s %6.3f s %6.3f s  %5ld MB\n", load, edit, teardown, mb);
+  runArena(&mb, &load, &edit, &teardown);
+  printf("arena        %6.3f s %6.3f s %6.3f s  %5ld MB\n", load, edit, teardown, mb);
+  return 0;
+}
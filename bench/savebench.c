@@ -0,0 +1,95 @@
+// Benchmark for saving. Generates a large log file, opens it the way the
+// editor does, edits a row near the start and one near the end, and saves it,
+// timing the save and how much the peak memory grew. The save runs in the
+// background, so the time until editorSave returns (how long the editor stops
+// taking keys) is shown apart from the time until the file is written. The
+// reference is the way kilo used to save: every row copied into one buffer,
+// written with write().
+//
+//   gcc -O2 -pthread -o savebench bench/savebench.c
+//   ./savebench [megabytes=500] [file=/tmp/kilo-savebench.log]
+
+#define KILO_NO_MAIN
+#include "../kilo.c"
+
+#include <sys/time.h>
+#include <sys/resource.h>
+
+double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+long peakKB(void) {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_maxrss;
+}
+
+// Writes about `mb` megabytes of log lines
+void generate(const char *path, long mb) {
+  FILE *fp = fopen(path, "w");
+  if (!fp) die("fopen");
+  long written = 0;
+  for (long n = 0; written < mb << 20; n++)
+    written += fprintf(fp, "2025-03-%02ld 12:%02ld:%02ld.%03ld INFO [worker-%ld] request id=%08lx took %ldms\n",
+      n % 28 + 1, n / 60 % 60, n % 60, n % 1000, n % 16, n * 2654435761u, n % 997);
+  fclose(fp);
+}
+
+// The old save: the whole text copied into one buffer, then written at once
+void copySave(const char *path) {
+  size_t len = 0;
+  for (int j = 0; j < E.numrows; j++) len += editorRowPeek(j)->size + 1;
+  char *buf = malloc(len);
+  char *p = buf;
+  for (int j = 0; j < E.numrows; j++) {
+    erow *row = editorRowPeek(j);
+    memcpy(p, editorRowData(row), row->size);
+    p += row->size;
+    *p++ = '\n';
+  }
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  for (size_t off = 0; off < len;) {
+    ssize_t w = write(fd, buf + off, len - off);
+    if (w <= 0) die("write");
+    off += w;
+  }
+  close(fd);
+  free(buf);
+}
+
+int main(int argc, char *argv[]) {
+  long mb = argc > 1 ? atol(argv[1]) : 500;
+  char *path = argc > 2 ? argv[2] : "/tmp/kilo-savebench.log";
+
+  generate(path, mb);
+  E.rowroot = rowNodeNew(1);
+  E.hldirty = INT_MAX;
+  E.nthreads = 1;
+  editorOpen(path);
+  printf("%s: %ld MB, %d rows\n", path, (long)(E.mapsize >> 20), E.numrows);
+  editorRowInsertChar(10, 0, '#');
+  editorRowInsertChar(E.numrows - 10, 0, '#');
+
+  printf("save          seconds  peak memory growth\n");
+  long before = peakKB();
+  double start = now();
+  editorSave();
+  double paused = now() - start;
+  editorSaveWait();
+  double secs = now() - start;
+  printf("streamed      %7.3f  %6ld MB   (%s)\n", secs, (peakKB() - before) >> 10, E.statusmsg);
+  printf("  editor paused %7.3f\n", paused);
+
+  char old[256];
+  snprintf(old, sizeof(old), "%s.old", path);
+  before = peakKB();
+  start = now();
+  copySave(old);
+  secs = now() - start;
+  printf("copy + write  %7.3f  %6ld MB\n", secs, (peakKB() - before) >> 10);
+  unlink(old);
+  return 0;
+}
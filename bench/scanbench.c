@@ -0,0 +1,175 @@
+// Differential check and benchmark for the byte scanners. Every scanner this
+// CPU supports is compared against scanScalar on random inputs, both directly
+// and through the highlighter, and then timed on generated C.
+//
+//   gcc -O2 -pthread -o scanbench bench/scanbench.c && ./scanbench [rows=200000]
+
+#define KILO_NO_MAIN
+#include "../kilo.c"
+
+#include <sys/time.h>
+
+double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+struct scanner {
+  const char *name;
+  int (*fn)(const char *, int, const struct byteSet *);
+};
+
+struct scanner scanners[3];
+int nscanners;
+
+void findScanners(void) {
+  scanners[nscanners++] = (struct scanner){ "scalar", scanScalar };
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) scanners[nscanners++] = (struct scanner){ "sse2", scanSSE2 };
+  if (__builtin_cpu_supports("avx2")) scanners[nscanners++] = (struct scanner){ "avx2", scanAVX2 };
+#endif
+}
+
+const char *pieces[] = {
+  "int", "if", "ifx", "unsigned", "char", "x", "\"s\"", "'c'", "/*", "*/", "//",
+  "12", "3.5", "(", ")", ";", " ", "\t", "switch", "struct", "void", "return;",
+  "a.b", "\\\\", "\"", "'", "\xe9\xe8", ",", "-", "case:", "identifier_name_long",
+};
+
+// A random row of C-like tokens in buf; returns its length
+int randomRow(char *buf) {
+  int len = 0;
+  int n = rand() % 24;
+  for (int k = 0; k < n; k++) {
+    const char *p = pieces[rand() % (sizeof(pieces) / sizeof(pieces[0]))];
+    int plen = strlen(p);
+    memcpy(&buf[len], p, plen);
+    len += plen;
+  }
+  return len;
+}
+
+void fail(const char *what, const char *name) {
+  printf("MISMATCH: %s with %s\n", what, name);
+  exit(1);
+}
+
+// Scanners against scanScalar on random bytes, sets and alignments
+void checkScanners(void) {
+  char buf[512];
+  struct byteSet sets[6] = { E.hlsep, E.hlword, E.hlcarry, E.hlquote[0], E.hlquote[1] };
+  long checks = 0;
+  for (int round = 0; round < 20000; round++) {
+    byteSetInit(&sets[5]);
+    int members = rand() % 40;  // past 32 the SSE2 scanner can't list them all
+    for (int k = 0; k < members; k++) byteSetAdd(&sets[5], rand() % 256);
+    for (unsigned int j = 0; j < sizeof(buf); j++)
+      buf[j] = (rand() % 4) ? 'a' + rand() % 26 : rand() % 256;
+    for (int k = 0; k < 6; k++) {
+      int off = rand() % 64;
+      int len = rand() % (int)(sizeof(buf) - off);
+      int want = scanScalar(&buf[off], len, &sets[k]);
+      for (int j = 1; j < nscanners; j++, checks++)
+        if (scanners[j].fn(&buf[off], len, &sets[k]) != want) fail("scan", scanners[j].name);
+    }
+  }
+  printf("scanners agree on %ld random scans\n", checks);
+}
+
+// Whole-row highlighting and comment carry with each scanner against scalar
+void checkHighlighter(char **rows, int *lens, int nrows) {
+  unsigned char *want = NULL;
+  int wantcap = 0;
+  for (int r = 0; r < nrows; r++) {
+    erow row = {0};
+    editorRowSetChars(&row, rows[r], lens[r]);
+    editorUpdateRow(&row);
+    for (int in = 0; in <= 1; in++) {
+      editorScan = scanScalar;
+      editorUpdateSyntax(&row, in);
+      int carry = editorSyntaxCarry(rows[r], lens[r], in);
+      if (row.rsize + 1 > wantcap) {
+        wantcap = row.rsize + 1;
+        want = realloc(want, wantcap);
+      }
+      memcpy(want, row.hl, row.rsize);
+      int open = row.hl_open_comment;
+      for (int j = 1; j < nscanners; j++) {
+        editorScan = scanners[j].fn;
+        editorUpdateSyntax(&row, in);
+        if (memcmp(want, row.hl, row.rsize) || row.hl_open_comment != open)
+          fail("highlight", scanners[j].name);
+        if (editorSyntaxCarry(rows[r], lens[r], in) != carry) fail("carry", scanners[j].name);
+      }
+    }
+    editorFreeRow(&row);
+  }
+  free(want);
+  printf("highlighter agrees on %d random rows\n", nrows);
+}
+
+void timeScanners(char **rows, int *lens, int nrows) {
+  long bytes = 0;
+  for (int r = 0; r < nrows; r++) bytes += lens[r];
+  erow *erows = calloc(nrows, sizeof(erow));
+  for (int r = 0; r < nrows; r++) {
+    editorRowSetChars(&erows[r], rows[r], lens[r]);
+    editorUpdateRow(&erows[r]);
+  }
+  printf("scanner  carry MB/s  highlight MB/s\n");
+  for (int j = 0; j < nscanners; j++) {
+    editorScan = scanners[j].fn;
+    double start = now();
+    int state = 0;
+    for (int pass = 0; pass < 10; pass++)
+      for (int r = 0; r < nrows; r++) state = editorSyntaxCarry(rows[r], lens[r], state);
+    double carry = now() - start;
+    start = now();
+    state = 0;
+    for (int r = 0; r < nrows; r++) {
+      editorUpdateSyntax(&erows[r], state);
+      state = erows[r].hl_open_comment;
+    }
+    double hl = now() - start;
+    printf("%-7s  %10.0f  %14.0f\n", scanners[j].name,
+           10 * bytes / carry / (1 << 20), bytes / hl / (1 << 20));
+  }
+  for (int r = 0; r < nrows; r++) editorFreeRow(&erows[r]);
+  free(erows);
+}
+
+int main(int argc, char *argv[]) {
+  int nrows = argc > 1 ? atoi(argv[1]) : 200000;
+  srand(1);
+  E.rowroot = rowNodeNew(1);
+  E.filename = "bench.c";
+  editorSelectSyntaxHighlight();
+  findScanners();
+
+  // Random token soup for the checks; plainer generated C for the timings
+  char **rows = malloc(sizeof(char *) * nrows);
+  int *lens = malloc(sizeof(int) * nrows);
+  char buf[1024];
+  for (int r = 0; r < nrows; r++) {
+    lens[r] = randomRow(buf);
+    rows[r] = malloc(lens[r] + 1);
+    memcpy(rows[r], buf, lens[r]);
+  }
+  checkScanners();
+  checkHighlighter(rows, lens, nrows);
+
+  for (int r = 0; r < nrows; r++) {
+    free(rows[r]);
+    if (r % 397 == 0)
+      lens[r] = snprintf(buf, sizeof(buf), "/* table %d, generated, do not edit */", r);
+    else if (r % 7 == 0)
+      lens[r] = snprintf(buf, sizeof(buf), "  { \"/* entry %d\", %d, 0x%x }, // row", r, r * 31, r);
+    else
+      lens[r] = snprintf(buf, sizeof(buf), "static int value_%d = %d + sizeof(long) * %d;", r, r, r % 13);
+    rows[r] = strdup(buf);
+  }
+  timeScanners(rows, lens, nrows);
+  return 0;
+}
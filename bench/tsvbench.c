@@ -0,0 +1,181 @@
+// Column mapping on wide tab-separated files. A TSV file of many rows of
+// short tab-separated fields is generated, with one very long line of them
+// in the middle, and the long line is used to time:
+//
+//   cx_to_rx      editorRowCxToRx at positions spread along the line
+//   rx_to_cx      editorRowRxToCx at columns spread along the line
+//   frame         editorRefreshScreen with the cursor near the end of the
+//                 line, moving a few characters each frame
+//   type char     editorInsertChar of a letter in the middle of the line,
+//                 patching its render and keeping its tab index up to date
+//   type tab      the same for a tab, which moves every later tab stop
+//
+// The mappings and frames are timed twice: through the row's tab index, and
+// walking the row from column 0 as the editor does for rows without one. The
+// walked mappings are checked against the indexed ones.
+//
+//   gcc -O2 -pthread -o tsvbench bench/tsvbench.c
+//   ./tsvbench [rows=20000] [fields=200] [line=1048576] [file=/tmp/kilo-tsvbench.tsv]
+
+#define KILO_NO_MAIN
+#include "../kilo.c"
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Writes rows of fields tab-separated fields, with a line of about line
+// bytes after the first half of them
+void generate(const char *path, int rows, int fields, long line) {
+  FILE *fp = fopen(path, "w");
+  if (!fp) die("fopen");
+  srand(3);
+  for (int y = 0; y < rows; y++) {
+    if (y == rows / 2) {
+      for (long n = 0, written = 0; written < line; n++)
+        written += fprintf(fp, "%s%ld", n ? "\t" : "", n * (rand() % 1000));
+      fprintf(fp, "\n");
+    }
+    for (int f = 0; f < fields; f++) fprintf(fp, "%s%d", f ? "\t" : "", rand() % (f % 7 == 0 ? 1000000 : 100));
+    fprintf(fp, "\n");
+  }
+  fclose(fp);
+}
+
+void discardFrame(const char *buf, int len) {
+  (void)buf;
+  (void)len;
+}
+
+// editorRowCxToRx as it is for rows without a tab index
+int walkCxToRx(erow *row, int cx) {
+  int rx = 0;
+  for (int j = 0; j < cx; j++) {
+    if (editorRowChar(row, j) == '\t') rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+    rx++;
+  }
+  return rx;
+}
+
+int walkRxToCx(erow *row, int rx) {
+  int cur_rx = 0;
+  int cx;
+  for (cx = 0; cx < row->size; cx++) {
+    if (editorRowChar(row, cx) == '\t') cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
+    cur_rx++;
+    if (cur_rx > rx) return cx;
+  }
+  return cx;
+}
+
+int longrow;  // Index of the long line
+
+// Takes the long line's tab index away, or gives it back, so that the editor
+// walks it instead
+void setIndexed(int on) {
+  static struct tabIndex *tabs;
+  erow *row = editorRowAt(longrow);
+  if (on) {
+    row->tabs = tabs;
+  } else {
+    tabs = row->tabs;
+    row->tabs = NULL;
+    row->gaprx = -1;
+  }
+}
+
+void result(const char *what, const char *how, long ops, double secs) {
+  printf("%-10s %-8s %9ld %12.1f\n", what, how, ops, secs / ops * 1e9);
+  fflush(stdout);
+}
+
+volatile int sink;
+
+// Times n conversions spread evenly along the long line, indexed then walked
+void timeMapping(int n) {
+  erow *row = editorRowAt(longrow);
+  int step = row->size / n + 1, rstep = row->rsize / n + 1;
+  double start = now();
+  for (int cx = 0; cx < row->size; cx += step) sink = editorRowCxToRx(row, cx);
+  result("cx_to_rx", "indexed", n, now() - start);
+  start = now();
+  for (int rx = 0; rx < row->rsize; rx += rstep) sink = editorRowRxToCx(row, rx);
+  result("rx_to_cx", "indexed", n, now() - start);
+
+  start = now();
+  for (int cx = 0; cx < row->size; cx += step)
+    if (walkCxToRx(row, cx) != editorRowCxToRx(row, cx)) die("cx_to_rx differs");
+  result("cx_to_rx", "walked", n, now() - start);
+  start = now();
+  for (int rx = 0; rx < row->rsize; rx += rstep)
+    if (walkRxToCx(row, rx) != editorRowRxToCx(row, rx)) die("rx_to_cx differs");
+  result("rx_to_cx", "walked", n, now() - start);
+}
+
+// Draws n frames with the cursor stepping left and right near the line's end
+void timeFrames(int n, const char *how) {
+  erow *row = editorRowAt(longrow);
+  E.cy = longrow;
+  E.screenvalid = 0;
+  double start = now();
+  for (int i = 0; i < n; i++) {
+    E.cx = row->size - 1 - (i % 100) * 3;
+    editorRefreshScreen();
+  }
+  result("frame", how, n, now() - start);
+}
+
+// Types n characters c at the middle of the long line. Its highlighting is
+// dropped first: that is redone over the whole line with each key, which
+// would swamp what the tab index costs.
+void timeTyping(int n, int c, const char *what) {
+  erow *row = editorRowAt(longrow);
+  E.cy = longrow;
+  E.cx = row->size / 2;
+  row->hl_in = -1;
+  double start = now();
+  for (int i = 0; i < n; i++) editorInsertChar(c);
+  result(what, "indexed", n, now() - start);
+}
+
+int main(int argc, char *argv[]) {
+  int rows = argc > 1 ? atoi(argv[1]) : 20000;
+  int fields = argc > 2 ? atoi(argv[2]) : 200;
+  long line = argc > 3 ? atol(argv[3]) : 1 << 20;
+  char *path = argc > 4 ? argv[4] : "/tmp/kilo-tsvbench.tsv";
+
+  generate(path, rows, fields, line);
+  static struct replayIO io = {NULL, discardFrame, 52, 200};
+  replay = &io;
+  initEditor();
+  E.longline = INT_MAX;  // the long line rendered whole, as walking it needs
+  editorOpen(path);
+  long bytes = 0, tabs = 0, indexbytes = 0;
+  for (int i = 0; i < E.numrows; i++) {
+    erow *row = editorRowAt(i);
+    bytes += row->size + 1;
+    if (row->tabs && row->tabs != &tabsNone) {
+      tabs += row->tabs->n;
+      indexbytes += row->tabs->cap;
+    }
+  }
+  longrow = rows / 2;
+  erow *row = editorRowAt(longrow);
+  printf("%s: %d rows, %ld bytes; long line %d bytes, %d columns\n",
+    path, E.numrows, bytes, row->size, row->rsize);
+  printf("tab indexes: %ld tabs in %ld bytes (%.1f%% of the text)\n", tabs, indexbytes,
+    indexbytes * 100.0 / bytes);
+  printf("kernel     mapping        ops        ns/op\n");
+
+  timeMapping(2000);
+  timeFrames(2000, "indexed");
+  setIndexed(0);
+  timeFrames(200, "walked");
+  setIndexed(1);
+  timeTyping(20000, 'x', "type char");
+  timeTyping(2000, '\t', "type tab");
+  unlink(path);
+  return 0;
+}
@@ -11,6 +11,30 @@
 #define KILO_VERSION "0.0.1"      // Version string for the editor
 #define KILO_TAB_STOP 8           // Number of spaces per tab when rendering
 #define KILO_QUIT_TIMES 3         // Number of times to confirm quit if unsaved changes exist
+#define ROW_LEAF_MAX 64           // Rows held by one leaf of the row tree
+#define ROW_NODE_MAX 32           // Children held by one internal node of the row tree
+#define HL_PARALLEL_LEAVES 256    // Checkpoint walks at least this many leaves long use the thread pool
+#define KILO_INPUT_BUF 65536      // Bytes of terminal input read at once
+#define KILO_PASTE_WAIT 50        // Empty reads (0.1 s each) before giving up on a paste's end
+#define KILO_KEY_WAIT 100         // Milliseconds to wait for the rest of an escape sequence
+#define KILO_FRAME_MS 16          // Least time between two frames while input keeps arriving
+#define FIND_CHUNK_ROWS 16384     // Rows (or candidate rows) per search chunk handed to the pool
+#define FIND_CHECK_ROWS 2048      // Rows searched between checks for a newer query
+#define KILO_SAVE_IOV 1024        // Pieces of text handed to one writev() when saving
+#define KILO_SAVE_COPY 65536      // Runs of unchanged text at least this long are copied file to file
+#define KILO_SAVE_TICK 100        // Milliseconds between redraws of a background save's progress
+#define REGEX_MAX_INST 20000      // NFA instructions a search pattern may compile to
+#define REGEX_MAX_REPEAT 1000     // Largest bound in a {m,n} repeat
+#define REGEX_DFA_STATES 1024     // DFA states cached before the cache starts over
+#define HL_RUN_BITS 28            // Bits of a highlight run holding its length; its class goes above
+#define ROW_CLASS_MAX 4096        // Largest row block carved from the arena; bigger ones are malloc'd
+#define ROW_CLASSES 28            // Size classes up to ROW_CLASS_MAX, see rowClass
+#define ROW_ARENA_CHUNK (1 << 20) // Bytes the row arena takes from malloc at a time
+#define PROF_SPANS 65536          // Timed spans KILO_TRACE keeps, the latest ones
+#define ROW_TAB_INDEX 1024        // Rows at least this long keep an index of their tabs
+#define ROW_LONG_LINE (1 << 20)   // Rows this long are rendered a window at a time (KILO_LONG_LINE sets it)
+#define ROW_WINDOW_MARGIN 1024    // Columns a long row's window reaches past each side of the screen
+#define ROW_CHECK_STEP 4096       // Bytes between a long row's highlighting checkpoints
 
 // Enum for non-ASCII keys, starting from 1000 to avoid collision with ASCII codes
 enum editorKey {
@@ -23,7 +47,9 @@ enum editorKey {
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  PASTE_START,              // Bracketed paste: the text follows, then PASTE_END
+  PASTE_END
 };
 
 
@@ -55,7 +81,18 @@ enum editorHighlight {
 #include <unistd.h>      // For read(), write(), STDIN_FILENO
 #include <time.h>        // For time(), used in message bar timeout
 #include <stdarg.h>      // For variable argument functions (status message formatting)
+#include <limits.h>      // For INT_MAX
+#include <stdint.h>      // For intptr_t, to pass a worker its number
+#include <pthread.h>     // For the worker thread pool
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>   // For the SSE2 and AVX2 byte scanners
+#endif
 #include <fcntl.h>       // For open() flags
+#include <sys/mman.h>    // For mmap() of opened files
+#include <sys/stat.h>    // For fstat() to size the mapping
+#include <sys/uio.h>     // For writev(), which saves a batch of rows at once
+#include <poll.h>        // For poll(), which the event loop sleeps in
+#include <signal.h>      // For sigaction(), to hear about terminal resizes
 
 /*** data ***/
 
@@ -70,17 +107,189 @@ struct editorSyntax {
   int flags;
 };
 
+// One slot of a compiled keyword table
+struct keywordSlot {
+  const char *word;       // Points into the syntax's keyword list; NULL if the slot is free
+  int len;                // Length without the trailing '|' of secondary keywords
+  unsigned char hl;       // HL_KEYWORD1 or HL_KEYWORD2
+};
+
+// A syntax's keywords compiled into a perfect hash: every keyword gets a slot
+// of its own, so a word is looked up with a single probe
+struct keywordTable {
+  struct keywordSlot *slots;
+  unsigned int mask;      // Number of slots - 1 (slots are a power of two)
+  unsigned int seed;      // Hash seed that placed every keyword without a collision
+  int maxlen;             // Longest keyword
+};
+
+// A set of bytes to scan for, kept in the form each scanner needs
+struct byteSet {
+  unsigned char in[256];  // 1 for members
+  unsigned char lo[16];   // Nibble tables: an ASCII byte is a member when
+  unsigned char hi[16];   // lo[low nibble] & hi[high nibble] is non-zero
+  unsigned char list[32]; // Members, for the SSE2 scanner
+  int nlist;
+  int ascii;              // 1 if no member is above 0x7f, as the nibble tables need
+};
+
+// A search string prepared for the substring finders
+struct needle {
+  const char *q;
+  int len;
+  int icase;              // 1 to ignore the case of ASCII letters
+  unsigned char first[2]; // First byte of q, in both cases when icase
+  unsigned char last[2];  // Last byte of q, likewise
+  int shift[256];         // Horspool skip for each (folded) byte under the window's end
+};
+
+#define KW_HASH_INIT(seed) (2166136261u ^ (seed))
+#define KW_HASH_STEP(h, c) (((h) ^ (unsigned char)(c)) * 16777619u)
+
+// A tab in a row: where it is in the text, and the render column it starts at
+struct tabStop {
+  int cx;
+  int rx;
+};
+
+// Index of a row's tabs. Typing moves the text of every tab after the cursor,
+// so rather than rewrite all their cx, the tabs from `from` on are taken to be
+// `shift` characters further on than they say, until an edit elsewhere. Their
+// columns, likewise, are `rshift` further on: once a tab moves by a whole tab
+// stop, every tab after it moves by as much.
+struct tabIndex {
+  int n;                   // Tabs in t
+  int cap;                 // Bytes allocated for the index
+  int from;                // First tab whose cx is off by shift, and rx by rshift
+  int shift;
+  int rshift;              // A multiple of KILO_TAB_STOP
+  struct rowWindow *win;   // Long rows only: see struct rowWindow
+  struct tabStop t[];
+};
+
+// A place in a long row where highlighting can start afresh: the character
+// before it is a plain separator, and `state` is what is open there (see
+// editorRowChecksFrom)
+struct rowCheck {
+  int cx;
+  int state;
+};
+
+// A row of at least E.longline bytes isn't rendered and highlighted whole:
+// render and hl hold only a window of columns around the screen, starting at
+// column rxoff of the row, and the window is redone when the screen leaves it.
+// Highlighting it starts at the last checkpoint before, kept here.
+struct rowWindow {
+  int in;                  // Comment state the row starts in that chk was found for, -1 if none
+  int end;                 // Comment state the row ends in, on the same assumption
+  int nchk;
+  int chkcap;
+  struct rowCheck *chk;    // A checkpoint every ROW_CHECK_STEP bytes or so, in order
+};
+
 // Represents one line (row) of text in the editor
 typedef struct erow {
-  int idx;
   int size;      // Number of characters in the row (not counting null terminator)
   int rsize;     // Rendered size (after expanding tabs into spaces)
-  char *chars;   // The raw characters in the line
-  char *render;
-  unsigned char *hl;  // Syntax highlight types for each character in render
+  char *chars;   // The raw characters in the line (NULL until the row is loaded), as a gap buffer
+  int gap;       // Start of the gap in chars; equal to size when the text is contiguous
+  int cap;       // Bytes allocated for chars: text, gap and one byte for the null
+  int gaprx;     // Render column of the gap, or -1 if not known
+  int rcap;      // Bytes allocated for render, 0 while render is chars
+  off_t foff;    // Offset of the line in the mapped file, -1 once the row's text differs from it
+  char *render;  // chars with tabs expanded; chars itself if it has no tabs and no gap
+  uint32_t *hl;  // Syntax highlight of render as runs: the length below HL_RUN_BITS, the type above
+  int nhl;       // Runs in hl
+  int hlcap;     // Bytes allocated for hl
+  struct tabIndex *tabs; // The row's tabs, so columns map without a walk: &tabsNone
+                         // if it has none, NULL if they aren't indexed (short rows)
   int hl_open_comment; // Flag indicating if the line is within a multi-line comment
+  int hl_in;     // Comment state hl was computed for, or -1 if hl is out of date
+  int savegen;   // Save whose snapshot shares chars while it runs, see editorRowUnshare
+  int rxoff;     // Column of the row that render and hl start at: 0 but for long rows
 } erow;
 
+// Node of the row tree, a B+tree counted by rows. A row's line number is its
+// position in the tree, found by summing the counts of the subtrees before it.
+typedef struct rowNode {
+  int leaf;                  // 1 for leaves, 0 for internal nodes
+  int n;                     // Rows (leaf) or children (internal) in use
+  int count;                 // Total rows in this subtree
+  int lazy;                  // Lazy leaf: its rows are lines [lazy, lazy+n) of E.lineoff, else -1
+  erow *rows;                // Leaf: ROW_LEAF_MAX row slots (NULL while lazy)
+  int hl_in;                 // Leaf: comment state its first row starts in, -1 if unknown
+  struct rowNode **child;    // Internal: ROW_NODE_MAX child slots
+} rowNode;
+
+// Where rows' chars, render and hl come from. Blocks are rounded up to a size
+// class and carved one after another out of big chunks; a freed block goes on
+// its class's free list for the next one that size. Only the main thread
+// allocates row memory, so there are no locks.
+struct rowArena {
+  char **chunks;
+  int nchunks, chunkcap;
+  char *bump;                // Unused end of the newest chunk
+  int left;                  // Its length
+  char *free[ROW_CLASSES];   // Freed blocks of each class, linked through their first bytes
+  long live;                 // Bytes in blocks handed out and not freed
+  long big;                  // Of those, bytes in blocks too big for a class
+  long allocs;               // Blocks handed out so far
+};
+
+// A block of row memory: chars a running save still reads
+struct rowBlock {
+  char *p;
+  int cap;
+};
+
+// A row as a save's snapshot has it: its text is head followed by tail
+struct saveRow {
+  const char *head;
+  int headlen;
+  const char *tail;
+  int taillen;
+};
+
+// A leaf of the row tree as a save's snapshot has it
+struct saveLeaf {
+  int lazy;                  // Lines [lazy, lazy+n) of E.lineoff, or -1 to use rows
+  int n;
+  struct saveRow *rows;
+};
+
+// A save running on a thread of its own. It writes a snapshot of the rows,
+// taken when the save began; rows that were loaded then share their chars
+// with it, and an edit to one of them copies the row first.
+struct saveJob {
+  int active;                // 1 from the snapshot until editorSaveFinish
+  int gen;                   // Rows with this savegen share chars with the snapshot
+  struct saveLeaf *leaves;
+  int nleaves, leafcap;
+  struct rowBlock *kept;     // Shared chars the rows have let go of, freed after the save
+  int nkept, keptcap;
+  off_t total;               // Bytes the snapshot comes to, about
+  off_t progress;            // Bytes handed to the file so far (atomic)
+  int dirty;                 // E.dirty when the snapshot was taken
+  int fd;                    // The temporary file being written
+  char *tmp;                 // Its name
+  char *target;              // The file it replaces
+  pthread_t thread;
+  int threaded;              // 1 if the writer got a thread, 0 if it ran in the foreground
+  int done[2];               // Pipe the writer wakes the event loop with
+  off_t len;                 // Bytes written, or -1 on failure
+  int err;                   // errno of the failure
+  long profstart, profend;   // When the writer started and finished, if profiling
+};
+
+// A screen's worth of cells, kept as two planes so runs copy with memcpy
+struct frame {
+  char *c;                // The byte in each cell
+  unsigned char *attr;    // Its editorHighlight class, plus CELL_INVERSE
+};
+
+#define CELL_INVERSE 8
+#define CELL_ATTRS 16
+
 // Global editor configuration (state)
 struct editorConfig {
   int cx, cy;                 // Cursor position in characters (x = column, y = row)
@@ -90,17 +299,51 @@ struct editorConfig {
   int screenrows;             // Number of visible rows in the terminal
   int screencols;             // Number of visible columns in the terminal
   int numrows;                // Number of rows currently in the file
-  erow *row;                  // Array of rows (the text buffer)
+  rowNode *rowroot;           // Root of the row tree (the text buffer)
+  rowNode *rowleaf;           // Leaf found by the last row lookup, reused for nearby rows
+  int rowleafbase;            // Index of the first row in rowleaf
+  off_t *lineoff;             // Start offset of each line of the mapping, plus one past the end
+  erow *gaprow;               // The one row whose gap may be away from its end (NULL if none)
+  int hlvalid;                // Leaf hl_in checkpoints are right for leaves starting before this row
+  int hldirty;                // Leaves starting after this row have checkpoints that agree with each other
+  char *map;                  // Read-only mapping of the opened file (NULL if none)
+  int mapfd;                  // The file that's mapped, kept open to copy from (-1 if none)
+  size_t mapsize;             // Length of the mapping in bytes
   char *filename;             // Name of the open file
   char statusmsg[80];         // Message displayed on the status bar
   time_t statusmsg_time;      // Time when the status message was set
+  int redraw;                 // 1 if the screen is owed a frame
+  long lastframe;             // When the last frame was drawn, in milliseconds
   struct termios orig_termios;// Stores original terminal attributes for restoration
   int dirty;     
   struct editorSyntax *syntax;             // Pointer to current syntax highlighting rules
+  struct keywordTable kw;     // syntax->keywords, compiled when the syntax is selected
+  struct byteSet hlsep;       // Separators, for is_separator
+  struct byteSet hlword;      // Bytes that can end a plain word: separators, quotes, comment starts
+  struct byteSet hlcarry;     // Bytes editorSyntaxCarry must look at outside strings and comments
+  struct byteSet hlquote[2];  // Bytes that matter inside a "..." and a '...' string
+  int nthreads;               // Threads (the main one included) that pooled jobs may use
+  int longline;               // Rows at least this long are long rows, see struct rowWindow
+  struct frame frame;         // The frame being drawn, screencols x (screenrows + 2) cells
+  struct frame screen;        // What the terminal shows, as of the last frame
+  int framecells;             // Cells allocated in each of frame and screen
+  int screenvalid;            // 0 until screen matches the terminal
+  long framebytes;            // Bytes written for the last frame
+  long outbytes;              // Bytes written for all frames
+  long frames;                // Frames drawn
+  int stats;                  // 1 if KILO_STATS is set: costs are shown, and printed on quit
+  int recordfd;               // KILO_RECORD's file, which gets a copy of all input (-1 if none)
 };
 
-// Global instance of editor configuration
-struct editorConfig E;
+// Global instance of editor configuration. longline has its default before
+// initEditor runs, for the benchmarks that set up E by hand.
+struct editorConfig E = {.longline = ROW_LONG_LINE};
+
+// The background save, if there is one
+struct saveJob save;
+
+// Row memory
+struct rowArena rowmem;
 
 /*** filetypes ***/
 
@@ -127,8 +370,19 @@ struct editorSyntax HLDB[] = {
 /*** prototypes ***/
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen(void);
+void editorScroll(void);
+void editorWaitKey(void);
+long editorNowMs(void);
 int editorReadKey(void);
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+erow *editorRowAt(int at);
+erow *editorRowPeek(int at);
+void rowNodeResetHl(rowNode *node);
+rowNode *rowTreeSeek(int at, int *base);
+char *editorRowData(erow *row);
+void editorFlattenGapRow(void);
+void editorRowWindow(erow *row);
+int editorRowWindowHolds(erow *row);
 
 /*** terminal handling ***/
 
@@ -142,6 +396,7 @@ void die(const char *s) {
 
 // Disables raw mode and restores the terminal's original settings
 void disableRawMode(void) {
+  write(STDOUT_FILENO, "\x1b[?2004l", 8);  // Bracketed paste off
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
     die("tcsetattr");
 }
@@ -167,32 +422,98 @@ void enableRawMode(void) {
   // Disable echo, canonical mode, extended input, and signals (Ctrl-C, etc.)
   raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
 
-  // Control behavior of read(): return after 0 bytes or 0.1 seconds
+  // Control behavior of read(): never block, waiting is done in poll()
   raw.c_cc[VMIN] = 0;
-  raw.c_cc[VTIME] = 1;
+  raw.c_cc[VTIME] = 0;
 
   // Apply modified terminal settings
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
     die("tcsetattr");
+
+  // Have pastes wrapped in \x1b[200~ ... \x1b[201~ so they can be told from typing
+  write(STDOUT_FILENO, "\x1b[?2004h", 8);
+}
+
+// Stands in for the terminal when a script is replayed (bench/replaybench.c):
+// keys come from read() rather than stdin, frames go to frame() rather than
+// stdout, and the screen is a fixed rows x cols
+struct replayIO {
+  // Copies up to len bytes of input into buf and returns how many. With next
+  // set the editor is idle and waits for the next key; otherwise it wants the
+  // rest of the one it is reading, and 0 means there is no more.
+  int (*read)(char *buf, int len, int next);
+  void (*frame)(const char *buf, int len);
+  int rows, cols;
+};
+
+struct replayIO *replay = NULL;
+
+// Terminal input, read in large chunks and handed out a byte at a time
+struct inputBuffer {
+  char b[KILO_INPUT_BUF];
+  int len;
+  int pos;                  // Next byte to hand out
+};
+
+struct inputBuffer input;
+
+// Refills the input buffer with whatever the terminal has sent, waiting up to
+// timeout milliseconds (-1: for ever) for something; returns the number of
+// bytes read
+int editorFillInput(int timeout) {
+  int nread;
+  if (replay) {
+    nread = replay->read(input.b, sizeof(input.b), timeout == -1);
+  } else {
+    struct pollfd in = {STDIN_FILENO, POLLIN, 0};
+    if (poll(&in, 1, timeout) <= 0) return 0;
+    nread = read(STDIN_FILENO, input.b, sizeof(input.b));
+    if (nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
+  }
+  if (nread <= 0) return 0;
+  if (E.recordfd != -1 && write(E.recordfd, input.b, nread) != nread) die("write");
+  input.len = nread;
+  input.pos = 0;
+  return nread;
+}
+
+// Reads one byte of input into *c; returns 0 if none arrived in time
+int editorReadByte(char *c) {
+  if (input.pos == input.len && editorFillInput(KILO_KEY_WAIT) == 0) return 0;
+  *c = input.b[input.pos++];
+  return 1;
+}
+
+// Returns 1 if input has been read that hasn't been handled yet
+int editorInputPending(void) {
+  return input.pos < input.len;
 }
 
 // Reads one keypress, handles escape sequences for arrow keys and others
 int editorReadKey(void) {
-  int nread;
   char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN) die("read");
-  }
+  do editorWaitKey(); while (editorReadByte(&c) != 1);
 
   // Handle escape sequences (starting with '\x1b')
   if (c == '\x1b') {
     char seq[3];
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+    if (editorReadByte(&seq[0]) != 1) return '\x1b';
+    if (editorReadByte(&seq[1]) != 1) return '\x1b';
 
     if (seq[0] == '[') {
       if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+        if (editorReadByte(&seq[2]) != 1) return '\x1b';
+        if (seq[2] >= '0' && seq[2] <= '9') {
+          // a longer number, as in \x1b[200~; read it up to the '~'
+          int num = (seq[1] - '0') * 10 + seq[2] - '0';
+          char d = 0;
+          while (editorReadByte(&d) == 1 && d >= '0' && d <= '9' && num < 1000)
+            num = num * 10 + d - '0';
+          if (d != '~') return '\x1b';
+          if (num == 200) return PASTE_START;
+          if (num == 201) return PASTE_END;
+          return '\x1b';
+        }
         if (seq[2] == '~') {
           switch (seq[1]) {
             case '1': return HOME_KEY;
@@ -234,7 +555,7 @@ int getCursorPosition(int *rows, int *cols) {
     return -1;
 
   while (i < sizeof(buf) - 1) {
-    if (read(STDIN_FILENO, &buf[i], 1) != 1)
+    if (editorReadByte(&buf[i]) != 1)
       break;
     if (buf[i] == 'R')
       break;
@@ -253,6 +574,11 @@ int getCursorPosition(int *rows, int *cols) {
 // Gets terminal window size using ioctl(); falls back to cursor method if needed
 int getWindowSize(int *rows, int *cols) {
   struct winsize ws;
+  if (replay) {
+    *rows = replay->rows;
+    *cols = replay->cols;
+    return 0;
+  }
   if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
     if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12)
       return -1;
@@ -264,21 +590,568 @@ int getWindowSize(int *rows, int *cols) {
   }
 }
 
+/*** profiling ***/
+
+// Timings of the hot paths, taken only when asked for: Ctrl-P shows the last
+// frame's in the status bar, and KILO_TRACE=file records every span and writes
+// them to file on quit as a Chrome trace (chrome://tracing, Perfetto).
+struct profSpan {
+  const char *name;
+  long start, dur;            // Nanoseconds on the monotonic clock
+  int tid;                    // 1 for the main thread, 2 for the save writer
+  const char *argname;        // What arg is (NULL if nothing)
+  long arg;
+};
+
+struct profiler {
+  int on;                     // 1 while timings are taken
+  int overlay;                // 1 if the status bar shows them
+  char *tracefile;            // KILO_TRACE's file (NULL if spans aren't kept)
+  struct profSpan *spans;     // The last PROF_SPANS spans, as a ring
+  long nspans;                // Spans recorded in all
+  long epoch;                 // When recording started; trace times count from it
+  long frame;                 // Nanoseconds the last frame took
+  long key;                   // And handling the last key
+  int rehl;                   // Rows highlighted since the last frame
+};
+
+struct profiler prof;
+
+long profNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Starts timing a span: its start, or 0 if timings are off
+static inline long profBegin(void) {
+  return prof.on ? profNow() : 0;
+}
+
+// Keeps a span for the trace, if there is one
+void profRecord(const char *name, long start, long end, int tid, const char *argname, long arg) {
+  if (prof.tracefile == NULL) return;
+  struct profSpan *sp = &prof.spans[prof.nspans++ % PROF_SPANS];
+  sp->name = name;
+  sp->start = start;
+  sp->dur = end - start;
+  sp->tid = tid;
+  sp->argname = argname;
+  sp->arg = arg;
+}
+
+// Ends the span begun at start; returns how long it took in nanoseconds
+long profEnd(long start, const char *name, const char *argname, long arg) {
+  if (start == 0) return 0;
+  long end = profNow();
+  profRecord(name, start, end, 1, argname, arg);
+  return end - start;
+}
+
+// Writes the kept spans, oldest first, as Chrome trace events
+void profWriteTrace(void) {
+  FILE *fp = fopen(prof.tracefile, "w");
+  if (!fp) return;
+  fprintf(fp, "{\"traceEvents\": [\n");
+  fprintf(fp, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, \"args\": {\"name\": \"main\"}},\n");
+  fprintf(fp, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 2, \"args\": {\"name\": \"save\"}}");
+  long first = prof.nspans > PROF_SPANS ? prof.nspans - PROF_SPANS : 0;
+  for (long k = first; k < prof.nspans; k++) {
+    struct profSpan *sp = &prof.spans[k % PROF_SPANS];
+    fprintf(fp, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+      sp->name, sp->tid, (sp->start - prof.epoch) / 1e3, sp->dur / 1e3);
+    if (sp->argname) fprintf(fp, ", \"args\": {\"%s\": %ld}", sp->argname, sp->arg);
+    fprintf(fp, "}");
+  }
+  fprintf(fp, "\n], \"displayTimeUnit\": \"ms\"}\n");
+  fclose(fp);
+}
+
+// Sets up profiling from KILO_TRACE: spans are kept from the start
+void profInit(void) {
+  prof.tracefile = getenv("KILO_TRACE");
+  if (prof.tracefile == NULL) return;
+  prof.spans = malloc(sizeof(struct profSpan) * PROF_SPANS);
+  prof.epoch = profNow();
+  prof.on = 1;
+  atexit(profWriteTrace);
+}
+
+// Ctrl-P: shows or hides the timings in the status bar
+void profToggleOverlay(void) {
+  prof.overlay = !prof.overlay;
+  prof.on = prof.overlay || prof.tracefile;
+}
+
+/*** thread pool ***/
+
+// Worker threads for jobs split into numbered chunks. poolRun hands the chunks
+// out one at a time to the workers and the calling thread, so a slow chunk
+// doesn't hold up the rest. Workers are started the first time they're needed.
+struct threadPool {
+  pthread_mutex_t lock;
+  pthread_cond_t work;        // Signalled when a job is posted
+  pthread_cond_t done;        // Signalled when a job's last chunk finishes
+  int started;                // Workers started so far
+  int active;                 // Workers taking part in the current job
+  void (*fn)(void *, int);    // The current job
+  void *arg;
+  int nchunks;                // Chunks in the current job
+  int next;                   // Next chunk to hand out
+  int running;                // Chunks handed out and not yet finished
+};
+
+struct threadPool pool = {
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+  0, 0, NULL, NULL, 0, 0, 0
+};
+
+// Runs chunks until the job has none left. Called with pool.lock held.
+void poolDrain(void) {
+  while (pool.next < pool.nchunks) {
+    int k = pool.next++;
+    void (*fn)(void *, int) = pool.fn;
+    void *arg = pool.arg;
+    pool.running++;
+    pthread_mutex_unlock(&pool.lock);
+    fn(arg, k);
+    pthread_mutex_lock(&pool.lock);
+    if (--pool.running == 0 && pool.next == pool.nchunks)
+      pthread_cond_signal(&pool.done);
+  }
+}
+
+void *poolWorker(void *arg) {
+  int id = (intptr_t)arg;
+  pthread_mutex_lock(&pool.lock);
+  while (1) {
+    while (id >= pool.active || pool.next == pool.nchunks)
+      pthread_cond_wait(&pool.work, &pool.lock);
+    poolDrain();
+  }
+  return NULL;
+}
+
+// Runs fn(arg, k) for k = 0 .. nchunks-1 on up to E.nthreads threads and
+// returns once every call has.
+void poolRun(void (*fn)(void *, int), void *arg, int nchunks) {
+  pthread_mutex_lock(&pool.lock);
+  while (pool.started < E.nthreads - 1) {
+    pthread_t t;
+    if (pthread_create(&t, NULL, poolWorker, (void *)(intptr_t)pool.started) != 0) break;
+    pthread_detach(t);
+    pool.started++;
+  }
+  pool.active = E.nthreads - 1;
+  pool.fn = fn;
+  pool.arg = arg;
+  pool.nchunks = nchunks;
+  pool.next = 0;
+  pthread_cond_broadcast(&pool.work);
+  poolDrain();
+  while (pool.running > 0) pthread_cond_wait(&pool.done, &pool.lock);
+  pool.nchunks = pool.next = 0;
+  pthread_mutex_unlock(&pool.lock);
+}
+
+
+/*** byte scanning ***/
+
+// Adds byte c to a set
+void byteSetAdd(struct byteSet *set, unsigned char c) {
+  if (set->in[c]) return;
+  set->in[c] = 1;
+  if (c & 0x80) set->ascii = 0;
+  else set->lo[c & 0x0f] |= 1 << (c >> 4);
+  if (set->nlist >= 0 && set->nlist < (int)sizeof(set->list)) set->list[set->nlist++] = c;
+  else set->nlist = -1;  // too many to compare one by one
+}
+
+void byteSetInit(struct byteSet *set) {
+  memset(set, 0, sizeof(*set));
+  set->ascii = 1;
+  for (int h = 0; h < 8; h++) set->hi[h] = 1 << h;
+}
+
+// Returns how many bytes at the start of s[0..len) are not in set
+int scanScalar(const char *s, int len, const struct byteSet *set) {
+  int i = 0;
+  while (i < len && !set->in[(unsigned char)s[i]]) i++;
+  return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Members among the 16 bytes at p, as a bit mask
+__attribute__((target("sse2")))
+unsigned int scanBlockSSE2(const char *p, const struct byteSet *set) {
+  __m128i v = _mm_loadu_si128((const __m128i *)p);
+  __m128i hit = _mm_setzero_si128();
+  for (int k = 0; k < set->nlist; k++)
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8(set->list[k])));
+  return _mm_movemask_epi8(hit);
+}
+
+// 16 bytes at a time, comparing them against each member. Short inputs and
+// large sets are left to the scalar loop.
+__attribute__((target("sse2")))
+int scanSSE2(const char *s, int len, const struct byteSet *set) {
+  if (len < 16 || set->nlist < 0) return scanScalar(s, len, set);
+  int i = 0;
+  for (; i + 16 <= len; i += 16) {
+    unsigned int mask = scanBlockSSE2(&s[i], set);
+    if (mask) return i + __builtin_ctz(mask);
+  }
+  if (i < len) {
+    // the last block overlaps bytes already checked; shift those out
+    unsigned int mask = scanBlockSSE2(&s[len - 16], set) >> (i - (len - 16));
+    if (mask) return i + __builtin_ctz(mask);
+  }
+  return len;
+}
+
+// Members among the 32 bytes at p, as a bit mask: each byte's nibbles index
+// the set's nibble tables, and it's a member when the two entries share a bit
+__attribute__((target("avx2")))
+unsigned int scanBlockAVX2(const char *p, __m256i lo, __m256i hi) {
+  __m256i nibble = _mm256_set1_epi8(0x0f);
+  __m256i v = _mm256_loadu_si256((const __m256i *)p);
+  __m256i l = _mm256_shuffle_epi8(lo, _mm256_and_si256(v, nibble));
+  __m256i h = _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+  __m256i miss = _mm256_cmpeq_epi8(_mm256_and_si256(l, h), _mm256_setzero_si256());
+  return ~(unsigned int)_mm256_movemask_epi8(miss);
+}
+
+// 32 bytes at a time, whatever the size of the set
+__attribute__((target("avx2")))
+int scanAVX2(const char *s, int len, const struct byteSet *set) {
+  if (len < 32 || !set->ascii) return scanSSE2(s, len, set);
+  __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->lo));
+  __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->hi));
+  int i = 0;
+  for (; i + 32 <= len; i += 32) {
+    unsigned int mask = scanBlockAVX2(&s[i], lo, hi);
+    if (mask) return i + __builtin_ctz(mask);
+  }
+  if (i < len) {
+    unsigned int mask = scanBlockAVX2(&s[len - 32], lo, hi) >> (i - (len - 32));
+    if (mask) return i + __builtin_ctz(mask);
+  }
+  return len;
+}
+#endif
+
+// An ASCII capital in lower case, when the needle ignores case
+static inline unsigned char needleFold(const struct needle *nd, unsigned char c) {
+  return (nd->icase && c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+}
+
+// The other case of an ASCII letter, other bytes as they are
+static inline unsigned char needleOtherCase(unsigned char c) {
+  return ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') ? c ^ 0x20 : c;
+}
+
+// Prepares q[0..len) (len > 0) for searching. q must outlive the needle.
+void needleInit(struct needle *nd, const char *q, int len, int icase) {
+  nd->q = q;
+  nd->len = len;
+  nd->icase = icase;
+  nd->first[0] = q[0];
+  nd->first[1] = icase ? needleOtherCase(q[0]) : q[0];
+  nd->last[0] = q[len - 1];
+  nd->last[1] = icase ? needleOtherCase(q[len - 1]) : q[len - 1];
+  for (int c = 0; c < 256; c++) nd->shift[c] = len;
+  for (int k = 0; k < len - 1; k++) nd->shift[needleFold(nd, q[k])] = len - 1 - k;
+}
+
+// 1 if the needle matches at s
+static inline int needleMatch(const struct needle *nd, const char *s) {
+  if (!nd->icase) return !memcmp(s, nd->q, nd->len);
+  for (int k = 0; k < nd->len; k++)
+    if (needleFold(nd, s[k]) != needleFold(nd, nd->q[k])) return 0;
+  return 1;
+}
+
+// Offset of the first match of the needle in s[0..len), or -1. Horspool: the
+// byte under the end of the window says how far the window can move on.
+int findHorspool(const struct needle *nd, const char *s, int len) {
+  int m = nd->len;
+  unsigned char last = needleFold(nd, nd->q[m - 1]);
+  for (int i = 0; i + m <= len;) {
+    unsigned char c = needleFold(nd, s[i + m - 1]);
+    if (c == last && needleMatch(nd, &s[i])) return i;
+    i += nd->shift[c];
+  }
+  return -1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// 16 windows at a time: a window is only verified when both its first and its
+// last byte match, which few do. The tail is left to Horspool.
+__attribute__((target("sse2")))
+int findSSE2(const struct needle *nd, const char *s, int len) {
+  int m = nd->len;
+  __m128i f0 = _mm_set1_epi8(nd->first[0]), f1 = _mm_set1_epi8(nd->first[1]);
+  __m128i l0 = _mm_set1_epi8(nd->last[0]), l1 = _mm_set1_epi8(nd->last[1]);
+  int i = 0;
+  for (; i + m - 1 + 16 <= len; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)&s[i]);
+    __m128i b = _mm_loadu_si128((const __m128i *)&s[i + m - 1]);
+    __m128i hit = _mm_and_si128(_mm_or_si128(_mm_cmpeq_epi8(a, f0), _mm_cmpeq_epi8(a, f1)),
+                                _mm_or_si128(_mm_cmpeq_epi8(b, l0), _mm_cmpeq_epi8(b, l1)));
+    for (unsigned int mask = _mm_movemask_epi8(hit); mask; mask &= mask - 1)
+      if (needleMatch(nd, &s[i + __builtin_ctz(mask)])) return i + __builtin_ctz(mask);
+  }
+  int at = findHorspool(nd, &s[i], len - i);
+  return (at == -1) ? -1 : i + at;
+}
+
+// The same with 32 windows at a time
+__attribute__((target("avx2")))
+int findAVX2(const struct needle *nd, const char *s, int len) {
+  int m = nd->len;
+  __m256i f0 = _mm256_set1_epi8(nd->first[0]), f1 = _mm256_set1_epi8(nd->first[1]);
+  __m256i l0 = _mm256_set1_epi8(nd->last[0]), l1 = _mm256_set1_epi8(nd->last[1]);
+  int i = 0;
+  for (; i + m - 1 + 32 <= len; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)&s[i]);
+    __m256i b = _mm256_loadu_si256((const __m256i *)&s[i + m - 1]);
+    __m256i hit = _mm256_and_si256(_mm256_or_si256(_mm256_cmpeq_epi8(a, f0), _mm256_cmpeq_epi8(a, f1)),
+                                   _mm256_or_si256(_mm256_cmpeq_epi8(b, l0), _mm256_cmpeq_epi8(b, l1)));
+    for (unsigned int mask = _mm256_movemask_epi8(hit); mask; mask &= mask - 1)
+      if (needleMatch(nd, &s[i + __builtin_ctz(mask)])) return i + __builtin_ctz(mask);
+  }
+  int at = findSSE2(nd, &s[i], len - i);
+  return (at == -1) ? -1 : i + at;
+}
+#endif
+
+// The scanner and substring finder in use; editorScanSelect picks the fastest
+// ones the CPU has
+int (*editorScan)(const char *s, int len, const struct byteSet *set) = scanScalar;
+int (*editorFindBytes)(const struct needle *nd, const char *s, int len) = findHorspool;
+
+void editorScanSelect(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    editorScan = scanAVX2;
+    editorFindBytes = findAVX2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    editorScan = scanSSE2;
+    editorFindBytes = findSSE2;
+  }
+#endif
+}
+
+
+/*** row memory ***/
+
+// Size class of an n-byte block, and the class's size in *size: multiples of
+// 16 up to 64, then four classes between one power of two and the next, so
+// rounding up wastes at most a fifth
+int rowClass(int n, int *size) {
+  if (n <= 64) {
+    int c = (n + 15) >> 4;
+    if (c == 0) c = 1;
+    *size = c << 4;
+    return c - 1;
+  }
+  int p = 64;
+  int c = 4;
+  while (p * 2 < n) {
+    p *= 2;
+    c += 4;
+  }
+  int step = p / 4;
+  int k = (n - p + step - 1) / step;
+  *size = p + k * step;
+  return c + k - 1;
+}
+
+// Returns a block of at least n bytes of row memory; *cap gets its real size,
+// which the row may use
+void *rowAlloc(int n, int *cap) {
+  rowmem.allocs++;
+  if (n > ROW_CLASS_MAX) {
+    *cap = n;
+    rowmem.live += n;
+    rowmem.big += n;
+    return malloc(n);
+  }
+  int size;
+  int c = rowClass(n, &size);
+  *cap = size;
+  rowmem.live += size;
+  char *p = rowmem.free[c];
+  if (p) {
+    memcpy(&rowmem.free[c], p, sizeof(char *));
+    return p;
+  }
+  if (rowmem.left < size) {
+    if (rowmem.nchunks == rowmem.chunkcap) {
+      rowmem.chunkcap = rowmem.chunkcap ? rowmem.chunkcap * 2 : 64;
+      rowmem.chunks = realloc(rowmem.chunks, sizeof(char *) * rowmem.chunkcap);
+    }
+    rowmem.bump = malloc(ROW_ARENA_CHUNK);
+    if (rowmem.bump == NULL) die("malloc");
+    rowmem.chunks[rowmem.nchunks++] = rowmem.bump;
+    rowmem.left = ROW_ARENA_CHUNK;
+  }
+  p = rowmem.bump;
+  rowmem.bump += size;
+  rowmem.left -= size;
+  return p;
+}
+
+// Gives back a block from rowAlloc, cap being the size it came with
+void rowFree(void *p, int cap) {
+  if (p == NULL) return;
+  rowmem.live -= cap;
+  if (cap > ROW_CLASS_MAX) {
+    rowmem.big -= cap;
+    free(p);
+    return;
+  }
+  int size;
+  int c = rowClass(cap, &size);
+  memcpy(p, &rowmem.free[c], sizeof(char *));
+  rowmem.free[c] = p;
+}
+
+// Moves a block of size cap (p may be NULL) to one of at least n bytes,
+// keeping what fits of its contents
+void *rowRealloc(void *p, int cap, int n, int *newcap) {
+  if (cap > ROW_CLASS_MAX && n > ROW_CLASS_MAX) {
+    rowmem.allocs++;
+    rowmem.live += n - cap;
+    rowmem.big += n - cap;
+    *newcap = n;
+    return realloc(p, n);
+  }
+  void *q = rowAlloc(n, newcap);
+  if (p) memcpy(q, p, cap < n ? cap : n);
+  rowFree(p, cap);
+  return q;
+}
+
+// Describes the row memory in use, for the message bar. Wasted bytes are
+// those of the arena not in a live block: free lists and the unused chunk end.
+int rowArenaStats(char *buf, int len) {
+  long wasted = (long)rowmem.nchunks * ROW_ARENA_CHUNK - (rowmem.live - rowmem.big);
+  return snprintf(buf, len, "rows: %.1f MB live, %.1f MB wasted, %ld allocations",
+    rowmem.live / 1048576.0, wasted / 1048576.0, rowmem.allocs);
+}
+
+// Frees all row memory at once. Every row's blocks go with it.
+void rowArenaRelease(void) {
+  for (int k = 0; k < rowmem.nchunks; k++) free(rowmem.chunks[k]);
+  free(rowmem.chunks);
+  long allocs = rowmem.allocs;
+  memset(&rowmem, 0, sizeof(rowmem));
+  rowmem.allocs = allocs;
+}
 
 /*** syntax highlighting ***/
 
 int is_separator(int c) {
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+  return E.hlsep.in[(unsigned char)c];
 }
 
+// Builds the byte sets the highlighter scans with for E.syntax
+void editorSyntaxSets(void) {
+  byteSetInit(&E.hlsep);
+  for (int c = 0; c < 0x80; c++)
+    if (isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL)
+      byteSetAdd(&E.hlsep, c);
+  byteSetInit(&E.hlcarry);
+  byteSetInit(&E.hlquote[0]);
+  byteSetInit(&E.hlquote[1]);
+  byteSetAdd(&E.hlquote[0], '"');
+  byteSetAdd(&E.hlquote[0], '\\');
+  byteSetAdd(&E.hlquote[1], '\'');
+  byteSetAdd(&E.hlquote[1], '\\');
+  if (E.syntax) {
+    char *delims[] = { E.syntax->singleline_comment_start,
+                       E.syntax->multiline_comment_start };
+    for (unsigned int j = 0; j < sizeof(delims) / sizeof(delims[0]); j++)
+      if (delims[j] && delims[j][0]) byteSetAdd(&E.hlcarry, delims[j][0]);
+    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+      byteSetAdd(&E.hlcarry, '"');
+      byteSetAdd(&E.hlcarry, '\'');
+    }
+  }
+  E.hlword = E.hlsep;
+  for (int c = 0; c < 256; c++)
+    if (E.hlcarry.in[c]) byteSetAdd(&E.hlword, c);
+}
 
-void editorUpdateSyntax(erow *row) {
-  row->hl = realloc(row->hl, row->rsize + 1);
-  memset(row->hl, HL_NORMAL, row->rsize);
-  row->hl[row->rsize] = 0;
-
-  if (E.syntax == NULL) return;
+// Compiles E.syntax->keywords into E.kw. Seeds are tried until one hashes
+// every keyword to a different slot, doubling the table if none does soon.
+// Keywords are matched as whole words, so they can't contain separators.
+void editorKeywordCompile(void) {
+  free(E.kw.slots);
+  memset(&E.kw, 0, sizeof(E.kw));
+  if (E.syntax == NULL || E.syntax->keywords[0] == NULL) return;
   char **keywords = E.syntax->keywords;
+  unsigned int n = 0;
+  while (keywords[n]) n++;
+  unsigned int size = 8;
+  while (size < n * 2) size *= 2;
+  for (unsigned int seed = 0;; seed++) {
+    if (seed > 0 && seed % 256 == 0) size *= 2;
+    E.kw.slots = realloc(E.kw.slots, sizeof(struct keywordSlot) * size);
+    memset(E.kw.slots, 0, sizeof(struct keywordSlot) * size);
+    E.kw.mask = size - 1;
+    E.kw.seed = seed;
+    E.kw.maxlen = 0;
+    unsigned int j;
+    for (j = 0; j < n; j++) {
+      int len = strlen(keywords[j]);
+      int kw2 = len > 0 && keywords[j][len - 1] == '|';
+      if (kw2) len--;
+      if (len == 0) continue;
+      unsigned int h = KW_HASH_INIT(seed);
+      for (int k = 0; k < len; k++) h = KW_HASH_STEP(h, keywords[j][k]);
+      struct keywordSlot *slot = &E.kw.slots[h & E.kw.mask];
+      if (slot->word) {
+        // the same word listed twice keeps its first type, as it always did
+        if (slot->len == len && !memcmp(slot->word, keywords[j], len)) continue;
+        break;
+      }
+      slot->word = keywords[j];
+      slot->len = len;
+      slot->hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+      if (len > E.kw.maxlen) E.kw.maxlen = len;
+    }
+    if (j == n) return;
+  }
+}
+
+// Looks up the word at s, which runs up to the next separator, hashing it as
+// it's scanned. Returns its highlight and sets *len if it's a keyword, else 0.
+int editorKeywordMatch(const char *s, int *len) {
+  if (E.kw.slots == NULL) return 0;
+  unsigned int h = KW_HASH_INIT(E.kw.seed);
+  int n = 0;
+  while (!is_separator(s[n])) {
+    if (n == E.kw.maxlen) return 0;  // longer than any keyword
+    h = KW_HASH_STEP(h, s[n]);
+    n++;
+  }
+  struct keywordSlot *slot = &E.kw.slots[h & E.kw.mask];
+  if (slot->word == NULL || slot->len != n || memcmp(slot->word, s, n)) return 0;
+  *len = n;
+  return slot->hl;
+}
+
+
+// Highlights row->render from position `from` on, entering it in comment state
+// `in_comment`; `from` must be 0 or just after a plain separator. Every hl byte
+// from `from` on is rewritten, so the same code patches part of a row after an
+// edit: there it stops at the first plain separator at or past `converge` whose
+// old hl was also plain, since everything after it is highlighted as before.
+// Returns 1 if it stopped early, else records the row's final comment state.
+int editorHighlightRow(erow *row, unsigned char *hl, int from, int in_comment, int converge) {
   char *scs = E.syntax->singleline_comment_start;
   char *mcs = E.syntax->multiline_comment_start;
   char *mce = E.syntax->multiline_comment_end;
@@ -287,32 +1160,35 @@ void editorUpdateSyntax(erow *row) {
   int mce_len = mce ? strlen(mce) : 0;
   int prev_sep = 1;
   int in_string = 0;
-  int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
-  int i = 0;
+  int i = from;
   while (i < row->rsize) {
     char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+    unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
     if (scs_len && !in_string && !in_comment) {
       if (!strncmp(&row->render[i], scs, scs_len)) {
-        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+        memset(&hl[i], HL_COMMENT, row->rsize - i);
         break;
       }
     }
     if (mcs_len && mce_len && !in_string) {
       if (in_comment) {
-        row->hl[i] = HL_MLCOMMENT;
+        hl[i] = HL_MLCOMMENT;
         if (!strncmp(&row->render[i], mce, mce_len)) {
-          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
+          memset(&hl[i], HL_MLCOMMENT, mce_len);
           i += mce_len;
           in_comment = 0;
           prev_sep = 1;
           continue;
         } else {
-          i++;
+          // nothing before the next possible end of the comment matters
+          char *end = memchr(&row->render[i + 1], mce[0], row->rsize - i - 1);
+          int next = end ? end - row->render : row->rsize;
+          memset(&hl[i], HL_MLCOMMENT, next - i);
+          i = next;
           continue;
         }
       } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-        memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
+        memset(&hl[i], HL_MLCOMMENT, mcs_len);
         i += mcs_len;
         in_comment = 1;
         continue;
@@ -320,20 +1196,26 @@ void editorUpdateSyntax(erow *row) {
     }
     if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
       if (in_string) {
-        row->hl[i] = HL_STRING;
+        hl[i] = HL_STRING;
         if (c == '\\' && i + 1 < row->rsize) {
-          row->hl[i + 1] = HL_STRING;
+          hl[i + 1] = HL_STRING;
           i += 2;
           continue;
         }
         if (c == in_string) in_string = 0;
         i++;
         prev_sep = 1;
+        if (in_string) {
+          int run = editorScan(&row->render[i], row->rsize - i,
+                               &E.hlquote[in_string == '"' ? 0 : 1]);
+          memset(&hl[i], HL_STRING, run);
+          i += run;
+        }
         continue;
       } else {
         if (c == '"' || c == '\'') {
           in_string = c;
-          row->hl[i] = HL_STRING;
+          hl[i] = HL_STRING;
           i++;
           continue;
         }
@@ -342,37 +1224,190 @@ void editorUpdateSyntax(erow *row) {
     if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
       if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
           (c == '.' && prev_hl == HL_NUMBER)) {
-        row->hl[i] = HL_NUMBER;
+        hl[i] = HL_NUMBER;
         i++;
         prev_sep = 0;
         continue;
       }
     }
     if (prev_sep) {
-      int j;
-      for (j = 0; keywords[j]; j++) {
-        int klen = strlen(keywords[j]);
-        int kw2 = keywords[j][klen - 1] == '|';
-        if (kw2) klen--;
-        if (!strncmp(&row->render[i], keywords[j], klen) &&
-            is_separator(row->render[i + klen])) {
-          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-          i += klen;
-          break;
-        }
-      }
-      if (keywords[j] != NULL) {
+      int klen;
+      int kw = editorKeywordMatch(&row->render[i], &klen);
+      if (kw) {
+        memset(&hl[i], kw, klen);
+        i += klen;
         prev_sep = 0;
         continue;
       }
     }
+    unsigned char old_hl = hl[i];
+    hl[i] = HL_NORMAL;
     prev_sep = is_separator(c);
+    if (prev_sep && i >= converge && old_hl == HL_NORMAL) return 1;
     i++;
+    if (!prev_sep) {
+      // the rest of a word is plain text up to a separator, quote or comment start
+      int run = editorScan(&row->render[i], row->rsize - i, &E.hlword);
+      memset(&hl[i], HL_NORMAL, run);
+      i += run;
+    }
   }
-  int changed = (row->hl_open_comment != in_comment);
   row->hl_open_comment = in_comment;
-  if (changed && row->idx + 1 < E.numrows)
-    editorUpdateSyntax(&E.row[row->idx + 1]);
+  return 0;
+}
+
+// A buffer of at least n bytes for the hl of the row being highlighted, one
+// type per render column. Only the main thread highlights, so one is shared.
+unsigned char *hlScratch(int n) {
+  static unsigned char *buf;
+  static int cap;
+  if (n > cap) {
+    cap = (n > cap * 2) ? n : cap * 2;
+    buf = realloc(buf, cap);
+  }
+  return buf;
+}
+
+// Writes the highlight type of render columns [from, from+len) into out
+void hlExpand(erow *row, int from, int len, unsigned char *out) {
+  int k = 0, x = 0;
+  while (k < row->nhl && x + (int)(row->hl[k] & ((1u << HL_RUN_BITS) - 1)) <= from)
+    x += row->hl[k++] & ((1u << HL_RUN_BITS) - 1);
+  unsigned char *end = out + len;
+  for (; k < row->nhl && out < end; k++) {
+    int n = x + (row->hl[k] & ((1u << HL_RUN_BITS) - 1)) - from;
+    if (n > end - out) n = end - out;
+    unsigned char type = row->hl[k] >> HL_RUN_BITS;
+    // most runs are a word or two: a plain loop beats calling memset
+    if (n < 32) for (int i = 0; i < n; i++) out[i] = type;
+    else memset(out, type, n);
+    out += n;
+    from += n;
+    x = from;
+  }
+  if (out < end) memset(out, HL_NORMAL, end - out);  // not highlighted yet
+}
+
+// Stores hl, one type per render column, as the row's runs
+void hlCompress(erow *row, const unsigned char *hl) {
+  int max = (1 << HL_RUN_BITS) - 1;
+  int n = 0;
+  for (int i = 0; i < row->rsize; n++) {
+    int j = i + 1;
+    while (j < row->rsize && hl[j] == hl[i] && j - i < max) j++;
+    i = j;
+  }
+  int bytes = n * sizeof(uint32_t);
+  if (bytes > row->hlcap || bytes * 4 < row->hlcap) {
+    rowFree(row->hl, row->hlcap);
+    row->hl = NULL;
+    row->hlcap = 0;
+    if (bytes) row->hl = rowAlloc(bytes, &row->hlcap);
+  }
+  n = 0;
+  for (int i = 0; i < row->rsize; n++) {
+    int j = i + 1;
+    while (j < row->rsize && hl[j] == hl[i] && j - i < max) j++;
+    row->hl[n] = (uint32_t)hl[i] << HL_RUN_BITS | (j - i);
+    i = j;
+  }
+  row->nhl = n;
+}
+
+// Highlights all of a loaded row, which starts in comment state `in_comment`
+void editorUpdateSyntax(erow *row, int in_comment) {
+  long t = profBegin();
+  row->hl_in = in_comment;
+  if (row->tabs && row->tabs->win) {
+    editorRowWindow(row);  // only the columns around the screen
+    prof.rehl++;
+    profEnd(t, "editorUpdateSyntax", "bytes", row->rsize);
+    return;
+  }
+  unsigned char *hl = hlScratch(row->rsize + 1);
+  if (E.syntax == NULL) {
+    memset(hl, HL_NORMAL, row->rsize);
+    row->hl_open_comment = 0;
+  } else {
+    editorHighlightRow(row, hl, 0, in_comment, row->rsize);
+  }
+  hlCompress(row, hl);
+  prof.rehl++;
+  profEnd(t, "editorUpdateSyntax", "bytes", row->rsize);
+}
+
+// Highlights a loaded row unless its hl was already computed for the comment
+// state it starts in (and, for a long row, holds the columns on screen).
+// Returns the state the next row starts in.
+int editorRowHighlight(erow *row, int in_comment) {
+  if (row->hl_in != in_comment || !editorRowWindowHolds(row)) editorUpdateSyntax(row, in_comment);
+  return row->hl_open_comment;
+}
+
+// Runs only the comment and string tracking of editorHighlightRow over raw
+// row text, to find the comment state the row ends in without highlighting it.
+// Tabs, numbers and keywords can't open or close either, so they are skipped.
+int editorSyntaxCarry(const char *s, int len, int in_comment) {
+  char *scs = E.syntax->singleline_comment_start;
+  char *mcs = E.syntax->multiline_comment_start;
+  char *mce = E.syntax->multiline_comment_end;
+  int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = mcs ? strlen(mcs) : 0;
+  int mce_len = mce ? strlen(mce) : 0;
+  int strings = E.syntax->flags & HL_HIGHLIGHT_STRINGS;
+  int in_string = 0;
+  int i = 0;
+  while (i < len) {
+    char c = s[i];
+    if (scs_len && !in_string && !in_comment && c == scs[0] &&
+        i + scs_len <= len && !memcmp(&s[i], scs, scs_len))
+      break;
+    if (mcs_len && mce_len && !in_string) {
+      if (in_comment) {
+        if (c == mce[0] && i + mce_len <= len && !memcmp(&s[i], mce, mce_len)) {
+          i += mce_len;
+          in_comment = 0;
+        } else {
+          char *end = memchr(&s[i + 1], mce[0], len - i - 1);
+          i = end ? end - s : len;
+        }
+        continue;
+      } else if (c == mcs[0] && i + mcs_len <= len && !memcmp(&s[i], mcs, mcs_len)) {
+        i += mcs_len;
+        in_comment = 1;
+        continue;
+      }
+    }
+    if (strings && in_string) {
+      if (c == '\\' && i + 1 < len) {
+        i += 2;
+        continue;
+      }
+      if (c == in_string) in_string = 0;
+    } else if (strings && (c == '"' || c == '\'')) {
+      in_string = c;
+    }
+    i++;
+
+    // skip straight to the next byte that can change the state
+    if (in_string)
+      i += editorScan(&s[i], len - i, &E.hlquote[in_string == '"' ? 0 : 1]);
+    else
+      i += editorScan(&s[i], len - i, &E.hlcarry);
+  }
+  return in_comment;
+}
+
+// Longest stretch of text past a position that can change how that position is
+// highlighted: a keyword plus the separator after it, or a comment delimiter.
+int editorSyntaxLookahead(void) {
+  int n = E.kw.maxlen + 1;
+  char *delims[] = { E.syntax->singleline_comment_start,
+                     E.syntax->multiline_comment_start,
+                     E.syntax->multiline_comment_end };
+  for (unsigned int j = 0; j < sizeof(delims) / sizeof(delims[0]); j++)
+    if (delims[j] && (int)strlen(delims[j]) > n) n = strlen(delims[j]);
+  return n;
 }
 
 int editorSyntaxToColor(int hl) {
@@ -400,316 +1435,2822 @@ void editorSelectSyntaxHighlight() {
       if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
           (!is_ext && strstr(E.filename, s->filematch[i]))) {
         E.syntax = s;
+        break;
+      }
+      i++;
+    }
+    if (E.syntax) break;
+  }
+  editorKeywordCompile();
+  editorSyntaxSets();
+  editorScanSelect();
+
+  // Rows are highlighted as they are drawn; forget everything worked out so far
+  rowNodeResetHl(E.rowroot);
+  E.hlvalid = 0;
+  E.hldirty = INT_MAX;
+}
 
-        int filerow;
-        for (filerow = 0; filerow < E.numrows; filerow++) {
-          editorUpdateSyntax(&E.row[filerow]);
-        }
 
-        return;
+/*** row tree ***/
+
+// Allocates an empty leaf or internal node
+rowNode *rowNodeNew(int leaf) {
+  rowNode *node = calloc(1, sizeof(rowNode));
+  node->leaf = leaf;
+  node->lazy = -1;
+  node->hl_in = -1;
+  if (leaf) node->rows = malloc(sizeof(erow) * ROW_LEAF_MAX);
+  else node->child = malloc(sizeof(rowNode *) * ROW_NODE_MAX);
+  return node;
+}
+
+void rowNodeFree(rowNode *node) {
+  free(node->rows);
+  free(node->child);
+  free(node);
+}
+
+// Fills in a lazy leaf's rows from the line index. The rows stay unloaded.
+void rowLeafMaterialize(rowNode *leaf) {
+  leaf->rows = malloc(sizeof(erow) * ROW_LEAF_MAX);
+  for (int j = 0; j < leaf->n; j++) {
+    off_t start = E.lineoff[leaf->lazy + j];
+    off_t end = E.lineoff[leaf->lazy + j + 1] - 1;  // the '\n', or one past the mapping
+    while (end > start && E.map[end - 1] == '\r') end--;
+    erow *row = &leaf->rows[j];
+    row->size = end - start;
+    row->foff = start;
+    row->chars = NULL;
+    row->rsize = 0;
+    row->rcap = 0;
+    row->render = NULL;
+    row->hl = NULL;
+    row->nhl = 0;
+    row->hlcap = 0;
+    row->tabs = NULL;
+    row->rxoff = 0;
+    row->hl_open_comment = 0;
+    row->hl_in = -1;
+  }
+  leaf->lazy = -1;
+}
+
+// Finds the leaf holding row `at` and the index of its first row. The leaf
+// may still be lazy.
+rowNode *rowTreeLeaf(int at, int *base) {
+  rowNode *node = E.rowleaf;
+  if (node && at >= E.rowleafbase && at < E.rowleafbase + node->n) {
+    *base = E.rowleafbase;
+    return node;
+  }
+  node = rowTreeSeek(at, base);
+  E.rowleaf = node;
+  E.rowleafbase = *base;
+  return node;
+}
+
+// rowTreeLeaf without the one-leaf cache, so pool threads can share the tree
+rowNode *rowTreeSeek(int at, int *base) {
+  rowNode *node = E.rowroot;
+  int b = 0;
+  while (!node->leaf) {
+    int i = 0;
+    while (at - b >= node->child[i]->count) b += node->child[i++]->count;
+    node = node->child[i];
+  }
+  *base = b;
+  return node;
+}
+
+// Inserts *row at position `at` below node. If node had to split, returns
+// the new right half so the caller can link it in next to node.
+rowNode *rowTreeInsert(rowNode *node, int at, erow *row) {
+  rowNode *right = NULL;
+  node->count++;
+  if (node->leaf) {
+    if (node->lazy != -1) rowLeafMaterialize(node);
+    rowNode *dst = node;
+    if (node->n == ROW_LEAF_MAX) {
+      int half = ROW_LEAF_MAX / 2;
+      right = rowNodeNew(1);
+      right->n = node->n - half;
+      memcpy(right->rows, &node->rows[half], sizeof(erow) * right->n);
+      node->n = half;
+      if (at > half) {
+        dst = right;
+        at -= half;
       }
-      i++;
     }
+    memmove(&dst->rows[at + 1], &dst->rows[at], sizeof(erow) * (dst->n - at));
+    dst->rows[at] = *row;
+    dst->n++;
+    if (right) {
+      node->count = node->n;
+      right->count = right->n;
+    }
+    return right;
+  }
+
+  int i = 0;
+  while (i < node->n - 1 && at > node->child[i]->count) at -= node->child[i++]->count;
+  rowNode *split = rowTreeInsert(node->child[i], at, row);
+  if (split == NULL) return NULL;
+
+  rowNode *dst = node;
+  i++;
+  if (node->n == ROW_NODE_MAX) {
+    int half = ROW_NODE_MAX / 2;
+    right = rowNodeNew(0);
+    right->n = node->n - half;
+    memcpy(right->child, &node->child[half], sizeof(rowNode *) * right->n);
+    node->n = half;
+    if (i > half) {
+      dst = right;
+      i -= half;
+    }
+  }
+  memmove(&dst->child[i + 1], &dst->child[i], sizeof(rowNode *) * (dst->n - i));
+  dst->child[i] = split;
+  dst->n++;
+  if (right) {
+    node->count = 0;
+    for (int j = 0; j < node->n; j++) node->count += node->child[j]->count;
+    right->count = 0;
+    for (int j = 0; j < right->n; j++) right->count += right->child[j]->count;
+  }
+  return right;
+}
+
+// Evens out children j and j + 1 of node after one fell below a quarter full:
+// they become one if they fit in one, else share their rows (or children)
+// half and half. base is the first row of child j. A leaf whose first row
+// changes loses its hl_in checkpoint.
+void rowNodeJoin(rowNode *node, int j, int base) {
+  rowNode *left = node->child[j];
+  rowNode *right = node->child[j + 1];
+  int max = left->leaf ? ROW_LEAF_MAX : ROW_NODE_MAX;
+  if (left->leaf) {
+    if (left->lazy != -1) rowLeafMaterialize(left);
+    if (right->lazy != -1) rowLeafMaterialize(right);
+  }
+  int total = left->n + right->n;
+  int keep = (total <= max) ? total : total / 2;  // What left ends up with
+  if (keep > left->n) {
+    // the head of right moves to the end of left
+    int k = keep - left->n;
+    if (left->leaf) {
+      memcpy(&left->rows[left->n], right->rows, sizeof(erow) * k);
+      memmove(right->rows, &right->rows[k], sizeof(erow) * (right->n - k));
+    } else {
+      memcpy(&left->child[left->n], right->child, sizeof(rowNode *) * k);
+      memmove(right->child, &right->child[k], sizeof(rowNode *) * (right->n - k));
+    }
+  } else {
+    // the tail of left moves to the head of right
+    int k = left->n - keep;
+    if (left->leaf) {
+      memmove(&right->rows[k], right->rows, sizeof(erow) * right->n);
+      memcpy(right->rows, &left->rows[keep], sizeof(erow) * k);
+    } else {
+      memmove(&right->child[k], right->child, sizeof(rowNode *) * right->n);
+      memcpy(right->child, &left->child[keep], sizeof(rowNode *) * k);
+    }
+  }
+  left->n = keep;
+  right->n = total - keep;
+  if (left->leaf) {
+    left->count = left->n;
+    right->count = right->n;
+    right->hl_in = -1;
+    if (E.hlvalid > base + left->count) E.hlvalid = base + left->count;
+  } else {
+    left->count = 0;
+    for (int k = 0; k < left->n; k++) left->count += left->child[k]->count;
+    right->count = 0;
+    for (int k = 0; k < right->n; k++) right->count += right->child[k]->count;
+  }
+  if (right->n == 0) {
+    rowNodeFree(right);
+    memmove(&node->child[j + 1], &node->child[j + 2], sizeof(rowNode *) * (node->n - j - 2));
+    node->n--;
+  }
+}
+
+// Removes row `at` below node, whose first row is `base`, into *out.
+// Children left empty are freed, and those left less than a quarter full are
+// joined with a neighbour, so the tree stays balanced as it shrinks.
+void rowTreeDelete(rowNode *node, int at, int base, erow *out) {
+  node->count--;
+  if (node->leaf) {
+    if (node->lazy != -1) rowLeafMaterialize(node);
+    *out = node->rows[at];
+    memmove(&node->rows[at], &node->rows[at + 1], sizeof(erow) * (node->n - at - 1));
+    node->n--;
+    return;
+  }
+  int i = 0;
+  while (at >= node->child[i]->count) {
+    at -= node->child[i]->count;
+    base += node->child[i++]->count;
+  }
+  rowNode *child = node->child[i];
+  rowTreeDelete(child, at, base, out);
+  if (child->n == 0) {
+    rowNodeFree(child);
+    memmove(&node->child[i], &node->child[i + 1], sizeof(rowNode *) * (node->n - i - 1));
+    node->n--;
+  } else if (node->n > 1 && child->n < (child->leaf ? ROW_LEAF_MAX : ROW_NODE_MAX) / 4) {
+    if (i > 0) rowNodeJoin(node, i - 1, base - node->child[i - 1]->count);
+    else rowNodeJoin(node, i, base);
+  }
+}
+
+// Returns row `at` without loading it; size and foff are always valid
+erow *editorRowPeek(int at) {
+  int base;
+  rowNode *leaf = rowTreeLeaf(at, &base);
+  if (leaf->lazy != -1) rowLeafMaterialize(leaf);
+  return &leaf->rows[at - base];
+}
+
+// Marks the hl of every loaded row below node as out of date
+void rowNodeResetHl(rowNode *node) {
+  if (!node->leaf) {
+    for (int j = 0; j < node->n; j++) rowNodeResetHl(node->child[j]);
+    return;
+  }
+  if (node->lazy != -1) return;
+  for (int j = 0; j < node->n; j++) {
+    erow *row = &node->rows[j];
+    row->hl_in = -1;
+    if (row->tabs && row->tabs->win) row->tabs->win->in = -1;  // found with the old syntax
+  }
+}
+
+// Builds the tree over the E.numrows lines of E.lineoff bottom-up, leaving
+// every leaf lazy so opening costs nothing per row beyond the line index.
+void rowTreeBuild(void) {
+  int n = (E.numrows + ROW_LEAF_MAX - 1) / ROW_LEAF_MAX;
+  if (n == 0) return;
+  rowNode **level = malloc(sizeof(rowNode *) * n);
+  // rows and children are shared out evenly, so no node starts out underfull
+  for (int j = 0; j < n; j++) {
+    rowNode *leaf = calloc(1, sizeof(rowNode));
+    leaf->leaf = 1;
+    leaf->lazy = (long)j * E.numrows / n;
+    leaf->hl_in = -1;
+    leaf->n = leaf->count = (long)(j + 1) * E.numrows / n - leaf->lazy;
+    level[j] = leaf;
+  }
+  while (n > 1) {
+    int parents = (n + ROW_NODE_MAX - 1) / ROW_NODE_MAX;
+    for (int j = 0; j < parents; j++) {
+      rowNode *parent = rowNodeNew(0);
+      for (int k = j * n / parents; k < (j + 1) * n / parents; k++) {
+        parent->child[parent->n++] = level[k];
+        parent->count += level[k]->count;
+      }
+      level[j] = parent;
+    }
+    n = parents;
+  }
+  rowNodeFree(E.rowroot);
+  E.rowroot = level[0];
+  E.rowleaf = NULL;
+  free(level);
+}
+
+/*** syntax checkpoints ***/
+
+// Comment state at the end of row j of a leaf, given the state it starts in.
+// A row whose hl was computed for that state already knows; any other row is
+// scanned raw, straight from the mapping if it isn't loaded.
+int rowLeafCarryRow(rowNode *leaf, int j, int in_comment) {
+  if (leaf->lazy != -1) {
+    off_t start = E.lineoff[leaf->lazy + j];
+    off_t end = E.lineoff[leaf->lazy + j + 1] - 1;
+    while (end > start && E.map[end - 1] == '\r') end--;
+    return editorSyntaxCarry(&E.map[start], end - start, in_comment);
+  }
+  erow *row = &leaf->rows[j];
+  if (row->chars && row->hl_in == in_comment) return row->hl_open_comment;
+  if (row->chars && row->tabs && row->tabs->win && row->tabs->win->in == in_comment)
+    return row->tabs->win->end;  // a long row keeps its end state through edits
+  return editorSyntaxCarry(editorRowData(row), row->size, in_comment);
+}
+
+// Comment state at the end of a leaf, given the state its first row starts in
+int rowLeafCarry(rowNode *leaf, int in_comment) {
+  for (int j = 0; j < leaf->n; j++) in_comment = rowLeafCarryRow(leaf, j, in_comment);
+  return in_comment;
+}
+
+// A long checkpoint walk split into chunks of leaves for the thread pool.
+// Each chunk is scanned as if it started outside a comment.
+struct hlWalk {
+  rowNode **leaves;
+  int *state;    // State leaf i starts in, if its chunk started outside a comment
+  int *end;      // State each chunk ends in, on the same assumption
+  int nleaves;
+  int chunk;     // Leaves per chunk
+};
+
+void hlWalkChunk(void *arg, int k) {
+  struct hlWalk *w = arg;
+  int to = (k + 1) * w->chunk;
+  if (to > w->nleaves) to = w->nleaves;
+  int state = 0;
+  for (int i = k * w->chunk; i < to; i++) {
+    w->state[i] = state;
+    state = rowLeafCarry(w->leaves[i], state);
+  }
+  w->end[k] = state;
+}
+
+// Brings checkpoints up to date from leaf `from` (starting at row b, its own
+// checkpoint already right) through the leaf starting at row `base`, on all
+// threads. A chunk that turns out to really start inside a comment is then
+// rescanned, but only until its states agree with the guessed ones again.
+void editorSyntaxWalkParallel(rowNode *from, int b, int base) {
+  editorFlattenGapRow();  // rows are only read from here on
+  struct hlWalk w;
+  int cap = (base - b) / ROW_LEAF_MAX + 16;
+  w.leaves = malloc(sizeof(rowNode *) * cap);
+  w.nleaves = 0;
+  rowNode *leaf = from;
+  while (1) {
+    if (w.nleaves == cap) {
+      cap *= 2;
+      w.leaves = realloc(w.leaves, sizeof(rowNode *) * cap);
+    }
+    w.leaves[w.nleaves++] = leaf;
+    if (b == base) break;
+    leaf = rowTreeLeaf(b + leaf->n, &b);
+  }
+  int nchunks = E.nthreads * 4;
+  w.chunk = (w.nleaves + nchunks - 1) / nchunks;
+  nchunks = (w.nleaves + w.chunk - 1) / w.chunk;
+  w.state = malloc(sizeof(int) * w.nleaves);
+  w.end = malloc(sizeof(int) * nchunks);
+  poolRun(hlWalkChunk, &w, nchunks);
+
+  int state = from->hl_in;
+  for (int k = 0; k < nchunks; k++) {
+    int i = k * w.chunk;
+    int to = (i + w.chunk < w.nleaves) ? i + w.chunk : w.nleaves;
+    while (i < to && w.state[i] != state) {
+      w.state[i] = state;
+      state = rowLeafCarry(w.leaves[i++], state);
+    }
+    if (i < to) state = w.end[k];
+  }
+  for (int i = 1; i < w.nleaves; i++) w.leaves[i]->hl_in = w.state[i];
+  E.hlvalid = base + 1;
+  if (E.hldirty < base) E.hldirty = base;
+  free(w.leaves);
+  free(w.state);
+  free(w.end);
+}
+
+// Returns the comment state row `at` starts in. Each leaf keeps the state its
+// first row starts in; those past E.hlvalid are brought up to date first, one
+// leaf after another, stopping early at one that already held the right state
+// if nothing after it changed since the checkpoints last all agreed.
+int editorSyntaxStateAt(int at) {
+  if (E.syntax == NULL) return 0;
+  int base;
+  rowNode *leaf = rowTreeLeaf(at, &base);
+  if (base >= E.hlvalid) {
+    int b;
+    rowNode *cp;
+    if (E.hlvalid == 0) {
+      cp = rowTreeLeaf(0, &b);
+      cp->hl_in = 0;
+      E.hlvalid = 1;
+    } else {
+      cp = rowTreeLeaf(E.hlvalid - 1, &b);
+    }
+    while (b < base) {
+      // Nothing to stop early at before row `base`: hand long walks to the pool
+      if (E.nthreads > 1 && E.hldirty >= base &&
+          (base - b) / ROW_LEAF_MAX >= HL_PARALLEL_LEAVES) {
+        editorSyntaxWalkParallel(cp, b, base);
+        break;
+      }
+      int state = rowLeafCarry(cp, cp->hl_in);
+      cp = rowTreeLeaf(b + cp->n, &b);
+      if (b > E.hldirty && cp->hl_in == state) {
+        E.hlvalid = INT_MAX;
+        break;
+      }
+      cp->hl_in = state;
+      E.hlvalid = b + 1;
+      if (E.hldirty < b) E.hldirty = b;  // the leaf after it may disagree now
+    }
+    leaf = rowTreeLeaf(at, &base);
+  }
+  if (base + leaf->n == E.numrows) E.hlvalid = INT_MAX;
+  if (E.hlvalid == INT_MAX) E.hldirty = -1;
+
+  int state = leaf->hl_in;
+  for (int j = 0; j < at - base; j++) state = rowLeafCarryRow(leaf, j, state);
+  return state;
+}
+
+// The text of row `at` changed, so it may end in a different comment state
+// and leaves after it may start in a different one
+void editorSyntaxInvalidate(int at) {
+  if (E.hlvalid > at + 1) E.hlvalid = at + 1;
+  if (E.hldirty < at) E.hldirty = at;
+}
+
+// A row is about to be inserted (delta 1) or deleted (delta -1) at `at`. The
+// leaf it's in may split or vanish, so its checkpoint and later ones are redone.
+// A row inserted at a leaf boundary goes in the leaf before, that of row at - 1.
+void editorSyntaxRowsMoved(int at, int delta) {
+  if (E.numrows > 0) {
+    int base;
+    int row = (delta > 0 && at > 0) ? at - 1 : at;
+    rowTreeLeaf(row < E.numrows ? row : E.numrows - 1, &base);
+    if (E.hlvalid > base) E.hlvalid = base;
+  }
+  if (delta > 0 && E.hldirty >= at && E.hldirty != INT_MAX) E.hldirty++;
+  if (E.hldirty < at) E.hldirty = at;
+}
+
+/*** row operations ***/
+
+// Returns character j of a row, stepping over the gap in chars
+char editorRowChar(erow *row, int j) {
+  return row->chars[j < row->gap ? j : j + row->cap - 1 - row->size];
+}
+
+// Text position of tab k in a tab index
+int editorTabCx(struct tabIndex *ix, int k) {
+  return ix->t[k].cx + (k >= ix->from ? ix->shift : 0);
+}
+
+// Render column of tab k in a tab index
+int editorTabRx(struct tabIndex *ix, int k) {
+  return ix->t[k].rx + (k >= ix->from ? ix->rshift : 0);
+}
+
+// Returns how many of a row's indexed tabs come before text position cx
+int editorRowTabsBefore(erow *row, int cx) {
+  int lo = 0, hi = row->tabs->n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (editorTabCx(row->tabs, mid) < cx) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// Converts a cursor x-position into a rendered x-position (accounts for tabs).
+// With the row's tabs indexed, it is the column after the last tab before cx
+// plus the characters since; otherwise the row is walked. The gap sits at the
+// cursor while typing, so its known column is a shortcut for the walk.
+int editorRowCxToRx(erow *row, int cx) {
+  if (row->tabs) {
+    int k = editorRowTabsBefore(row, cx);
+    if (k == 0) return cx;
+    int after = (editorTabRx(row->tabs, k - 1) / KILO_TAB_STOP + 1) * KILO_TAB_STOP;
+    return after + cx - editorTabCx(row->tabs, k - 1) - 1;
+  }
+  int rx = 0;
+  int j = 0;
+  if (row->gaprx != -1 && cx >= row->gap) {
+    rx = row->gaprx;
+    j = row->gap;
+  }
+  for (; j < cx; j++) {
+    if (editorRowChar(row, j) == '\t')
+      rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+    rx++;
+  }
+  return rx;
+}
+
+// Converts a rendered x-position back into a cursor x-position: the character
+// drawn in column rx, or the end of the row if it is shorter
+int editorRowRxToCx(erow *row, int rx) {
+  if (row->tabs) {
+    // the last tab starting at or before rx; the characters after it are a column each
+    int lo = 0, hi = row->tabs->n;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (editorTabRx(row->tabs, mid) <= rx) lo = mid + 1;
+      else hi = mid;
+    }
+    int cx = rx;
+    if (lo > 0) {
+      int tabcx = editorTabCx(row->tabs, lo - 1);
+      int after = (editorTabRx(row->tabs, lo - 1) / KILO_TAB_STOP + 1) * KILO_TAB_STOP;
+      cx = (rx < after) ? tabcx : tabcx + 1 + rx - after;
+    }
+    return (cx < row->size) ? cx : row->size;
+  }
+  int cur_rx = 0;
+  int cx;
+  for (cx = 0; cx < row->size; cx++) {
+    if (editorRowChar(row, cx) == '\t')
+      cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
+    cur_rx++;
+    if (cur_rx > rx) return cx;
+  }
+  return cx;
+}
+
+// The index of rows without tabs, shared by them all and never written
+struct tabIndex tabsNone;
+
+// Frees a row's tab index, and its window if it is a long row, leaving the
+// row unindexed
+void editorRowTabsDrop(erow *row) {
+  if (row->tabs && row->tabs != &tabsNone) {
+    if (row->tabs->win) {
+      free(row->tabs->win->chk);
+      free(row->tabs->win);
+    }
+    rowFree(row->tabs, row->tabs->cap);
+  }
+  row->tabs = NULL;
+}
+
+// Makes room in a row's tab index for n tabs. It grows by doubling, and gives
+// most of its memory back when far fewer are needed. A long row keeps its
+// own index even without tabs, as that is where its window hangs.
+void editorRowTabsReserve(erow *row, int n) {
+  struct tabIndex *ix = (row->tabs == &tabsNone) ? NULL : row->tabs;
+  int cap = ix ? ix->cap : 0;
+  int bytes = sizeof(struct tabIndex) + n * sizeof(struct tabStop);
+  if (n == 0 && (ix == NULL || ix->win == NULL)) {
+    editorRowTabsDrop(row);
+    row->tabs = &tabsNone;
+    return;
+  }
+  if (bytes <= cap && bytes * 4 >= cap) return;
+  if (bytes > cap && bytes < cap * 2) bytes = cap * 2;
+  int newcap;
+  row->tabs = rowRealloc(ix, cap, bytes, &newcap);
+  if (ix == NULL) {
+    row->tabs->n = 0;
+    row->tabs->from = 0;
+    row->tabs->shift = 0;
+    row->tabs->rshift = 0;
+    row->tabs->win = NULL;
+  }
+  row->tabs->cap = newcap;
+}
+
+// Indexes the `tabs` tabs of a row from its text. Rows without tabs need no
+// index (rx is cx) and short ones are quick to walk, so only long rows with
+// tabs keep one.
+void editorRowIndexTabs(erow *row, int tabs) {
+  if (tabs > 0 && row->size < ROW_TAB_INDEX) {
+    editorRowTabsDrop(row);
+    return;
+  }
+  editorRowTabsReserve(row, tabs);
+  struct tabIndex *ix = row->tabs;
+  if (ix == &tabsNone) return;
+  ix->n = tabs;
+  ix->from = tabs;
+  ix->shift = 0;
+  ix->rshift = 0;
+  int k = 0, rx = 0, from = 0;
+  for (int j = 0; k < tabs; j++) {
+    if (editorRowChar(row, j) != '\t') continue;
+    rx += j - from;
+    ix->t[k].cx = j;
+    ix->t[k++].rx = rx;
+    rx = (rx / KILO_TAB_STOP + 1) * KILO_TAB_STOP;
+    from = j + 1;
+  }
+}
+
+// Brings a row's tab index up to date after nins characters went in at `at`,
+// render column rx, or after the one there came out when nins is 0. Tabs past
+// the edit move along with the text, and their columns change until one of
+// them lands where it was or a whole tab stop away: from there on the old
+// columns hold, give or take as many tab stops, and the tabs are left for the
+// index's shift and rshift to move.
+void editorRowPatchTabs(erow *row, int at, int nins, int rx) {
+  struct tabIndex *ix = row->tabs;
+  if (ix == NULL) {
+    if (row->size < ROW_TAB_INDEX) return;
+    int tabs = 0;  // long enough now to be worth indexing
+    for (int j = 0; j < row->size; j++)
+      if (editorRowChar(row, j) == '\t') tabs++;
+    editorRowIndexTabs(row, tabs);
+    return;
+  }
+  int k = editorRowTabsBefore(row, at);
+  int gone = (nins == 0 && k < ix->n && editorTabCx(ix, k) == at);
+  int added = 0;
+  for (int j = at; j < at + nins; j++)
+    if (editorRowChar(row, j) == '\t') added++;
+  if (ix->n == 0 && added == 0) return;
+
+  // Move the start of the shifted tabs to the edit: free when typing in one place
+  if (ix->from < k) {
+    for (int i = ix->from; i < k; i++) {
+      ix->t[i].cx += ix->shift;
+      ix->t[i].rx += ix->rshift;
+    }
+  } else {
+    for (int i = k; i < ix->from; i++) {
+      ix->t[i].cx -= ix->shift;
+      ix->t[i].rx -= ix->rshift;
+    }
+  }
+  if (ix->from != k) ix->from = k;
+  int pending = ix->shift;
+  int rpending = ix->rshift;
+
+  int n = ix->n - gone + added;
+  int rest = ix->n - k - gone;
+  if (n > ix->n) editorRowTabsReserve(row, n);  // grown before the tail moves up
+  if (added != gone && rest > 0)
+    memmove(&row->tabs->t[k + added], &row->tabs->t[k + gone], sizeof(struct tabStop) * rest);
+  if (n < row->tabs->n) editorRowTabsReserve(row, n);  // and shrunk after it moves down
+  ix = row->tabs;
+  if (ix == &tabsNone) return;
+  ix->n = n;
+  struct tabStop *t = ix->t;
+
+  int col = rx;
+  for (int j = at; j < at + nins; j++) {
+    if (editorRowChar(row, j) == '\t') {
+      t[k].cx = j;
+      t[k++].rx = col;
+      col = (col / KILO_TAB_STOP + 1) * KILO_TAB_STOP;
+    } else {
+      col++;
+    }
+  }
+  int shift = pending + nins - (nins == 0);
+  int from = at + nins;
+  int moved = 0;
+  while (k < n) {
+    t[k].cx += shift;
+    t[k].rx += rpending;
+    int tabrx = col + t[k++].cx - from;
+    moved = tabrx - t[k - 1].rx;
+    t[k - 1].rx = tabrx;
+    if (moved % KILO_TAB_STOP == 0) break;
+    col = (tabrx / KILO_TAB_STOP + 1) * KILO_TAB_STOP;
+    from = t[k - 1].cx + 1;
+  }
+  ix->from = k;
+  ix->shift = (k < n) ? shift : 0;
+  ix->rshift = (k < n) ? rpending + moved : 0;
+}
+
+// Whether highlighting can start afresh just after character c: a separator
+// that can't be part of a number, an escape, a quote or a comment delimiter
+int editorSyntaxRestart(char c) {
+  if (!is_separator(c) || c == '\0' || c == '.' || c == '\\' || c == '"' || c == '\'') return 0;
+  struct editorSyntax *s = E.syntax;
+  if (s->singleline_comment_start && strchr(s->singleline_comment_start, c)) return 0;
+  if (s->multiline_comment_start && strchr(s->multiline_comment_start, c)) return 0;
+  if (s->multiline_comment_end && strchr(s->multiline_comment_end, c)) return 0;
+  return 1;
+}
+
+// Whether the len bytes of s are in a row's text at `at`
+int editorRowMatch(erow *row, int at, const char *s, int len) {
+  if (at + len > row->size) return 0;
+  for (int i = 0; i < len; i++)
+    if (editorRowChar(row, at + i) != s[i]) return 0;
+  return 1;
+}
+
+// Finds a long row's checkpoints again from checkpoint k on, those before it
+// being right. The text is followed as editorHighlightRow would follow its
+// comments and strings, in state 0 in plain text, 1 in a multi-line comment,
+// 2 in a single-line one (which runs to the end of the row) or the quote of
+// the string it's in. It stops at the first old checkpoint it reaches in the
+// state found there before, since from there on nothing changed.
+void editorRowChecksFrom(erow *row, int k) {
+  static struct rowCheck *found;  // New checkpoints, until they replace old ones
+  static int foundcap;
+  struct rowWindow *w = row->tabs->win;
+  char *scs = E.syntax->singleline_comment_start;
+  char *mcs = E.syntax->multiline_comment_start;
+  char *mce = E.syntax->multiline_comment_end;
+  int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = (mcs && mce) ? strlen(mcs) : 0;
+  int mce_len = (mcs && mce) ? strlen(mce) : 0;
+  int strings = E.syntax->flags & HL_HIGHLIGHT_STRINGS;
+  int cx = k ? w->chk[k - 1].cx : 0;
+  int state = k ? w->chk[k - 1].state : w->in;
+  int last = cx;
+  int old = k;   // Next old checkpoint to compare with
+  int nfound = 0;
+  int synced = 0;
+  while (cx < row->size && state != 2) {
+    while (old < w->nchk && w->chk[old].cx < cx) old++;
+    if (old < w->nchk && w->chk[old].cx == cx && w->chk[old].state == state) {
+      synced = 1;
+      break;
+    }
+    char c = editorRowChar(row, cx);
+    int mark = (state == 0 || state == 1) && cx - last >= ROW_CHECK_STEP &&
+               editorSyntaxRestart(editorRowChar(row, cx - 1));
+    if (state == 0 && scs_len && c == scs[0] && editorRowMatch(row, cx, scs, scs_len)) {
+      state = 2;  // a window starting anywhere after here is all comment
+      mark = 1;
+    }
+    if (mark) {
+      if (nfound == foundcap) {
+        foundcap = foundcap ? foundcap * 2 : 64;
+        found = realloc(found, sizeof(struct rowCheck) * foundcap);
+      }
+      found[nfound].cx = cx;
+      found[nfound++].state = state;
+      last = cx;
+    }
+    if (state == 0) {
+      if (mcs_len && c == mcs[0] && editorRowMatch(row, cx, mcs, mcs_len)) {
+        cx += mcs_len;
+        state = 1;
+        continue;
+      }
+      if (strings && (c == '"' || c == '\'')) state = c;
+      cx++;
+    } else if (state == 1) {
+      if (c == mce[0] && editorRowMatch(row, cx, mce, mce_len)) {
+        cx += mce_len;
+        state = 0;
+        continue;
+      }
+      cx++;
+    } else if (state != 2) {
+      if (c == '\\' && cx + 1 < row->size) cx++;
+      else if (c == state) state = 0;
+      cx++;
+    }
+  }
+  int keep = synced ? w->nchk - old : 0;  // old checkpoints still right
+  int n = k + nfound + keep;
+  if (n > w->chkcap) {
+    w->chkcap = (n > w->chkcap * 2) ? n : w->chkcap * 2;
+    w->chk = realloc(w->chk, sizeof(struct rowCheck) * w->chkcap);
+  }
+  if (keep) memmove(&w->chk[k + nfound], &w->chk[old], sizeof(struct rowCheck) * keep);
+  if (nfound) memcpy(&w->chk[k], found, sizeof(struct rowCheck) * nfound);
+  w->nchk = n;
+  if (!synced) w->end = (state == 1);
+}
+
+// Brings a long row's checkpoints up to date after nins characters went in
+// at `at`, or the one there came out when nins is 0. Those before the edit
+// still hold, and those after move with the text; they are then checked
+// again from the edit on, which usually stops at the next one.
+void editorRowChecksEdit(erow *row, int at, int nins) {
+  struct rowWindow *w = row->tabs->win;
+  if (w->in == -1) return;
+  int lo = 0, hi = w->nchk;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (w->chk[mid].cx <= at) lo = mid + 1;
+    else hi = mid;
+  }
+  int k = lo;
+  for (int i = k; i < w->nchk; i++) w->chk[i].cx += nins ? nins : -1;
+  if (nins == 0 && k < w->nchk && w->chk[k].cx == at) {
+    // the separator before it is gone
+    memmove(&w->chk[k], &w->chk[k + 1], sizeof(struct rowCheck) * (w->nchk - k - 1));
+    w->nchk--;
+  }
+  // a single-line comment's start may have been edited
+  while (k > 0 && w->chk[k - 1].state == 2) k--;
+  editorRowChecksFrom(row, k);
+}
+
+// Whether a row's render and hl hold the columns on screen: always, but for
+// a long row whose window the screen has left
+int editorRowWindowHolds(erow *row) {
+  if (row->tabs == NULL || row->tabs->win == NULL) return 1;
+  int width = editorRowCxToRx(row, row->size);
+  int end = E.coloff + E.screencols;
+  if (end > width) end = width;
+  if (E.coloff >= end) return 1;  // nothing of the row on screen
+  return E.coloff >= row->rxoff && end <= row->rxoff + row->rsize;
+}
+
+// Renders and highlights a long row's columns from ROW_WINDOW_MARGIN before
+// the screen to as far past it, starting at the checkpoint before so the
+// highlighting is right. Its checkpoints are found first if they were found
+// for another comment state, or not yet.
+void editorRowWindow(erow *row) {
+  struct rowWindow *w = row->tabs->win;
+  row->hl_open_comment = 0;
+  if (E.syntax) {
+    if (w->in != row->hl_in) {
+      w->in = row->hl_in;
+      w->nchk = 0;
+      editorRowChecksFrom(row, 0);
+    }
+    row->hl_open_comment = w->end;
+  }
+  int from = E.coloff - ROW_WINDOW_MARGIN;
+  int cx = editorRowRxToCx(row, from > 0 ? from : 0);
+  int to = editorRowRxToCx(row, E.coloff + E.screencols + ROW_WINDOW_MARGIN) + 1;
+  if (to > row->size) to = row->size;
+  int state = 0;
+  if (E.syntax) {
+    // end after a separator too: a word cut short could highlight as another
+    while (to < row->size && !editorSyntaxRestart(editorRowChar(row, to - 1))) to++;
+    int lo = 0, hi = w->nchk;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (w->chk[mid].cx <= cx) lo = mid + 1;
+      else hi = mid;
+    }
+    state = lo ? w->chk[lo - 1].state : row->hl_in;
+    if (state != 2) cx = lo ? w->chk[lo - 1].cx : 0;
+  }
+
+  int rx = editorRowCxToRx(row, cx);
+  int len = editorRowCxToRx(row, to) - rx;
+  if (len + 1 > row->rcap || (len + 1) * 4 < row->rcap) {
+    rowFree(row->render, row->rcap);
+    row->render = rowAlloc(len + 1, &row->rcap);
+  }
+  char *out = row->render;
+  for (int j = cx, col = rx; j < to; j++) {
+    char c = editorRowChar(row, j);
+    if (c == '\t') {
+      do *out++ = ' '; while (++col % KILO_TAB_STOP != 0);
+    } else {
+      *out++ = c;
+      col++;
+    }
+  }
+  *out = '\0';
+  row->rxoff = rx;
+  row->rsize = len;
+
+  unsigned char *hl = hlScratch(len + 1);
+  if (E.syntax == NULL || state == 2) {
+    memset(hl, E.syntax ? HL_COMMENT : HL_NORMAL, len);
+  } else {
+    int end = row->hl_open_comment;  // the window's end isn't the row's
+    editorHighlightRow(row, hl, 0, state, len);
+    row->hl_open_comment = end;
+  }
+  hlCompress(row, hl);
+}
+
+// Makes a row a long row (on) or an ordinary one. A long row's render and hl
+// are emptied, to be filled with a window when drawn.
+void editorRowSetLong(erow *row, int on) {
+  if (!on) {
+    if (row->tabs && row->tabs->win) {
+      free(row->tabs->win->chk);
+      free(row->tabs->win);
+      row->tabs->win = NULL;
+      if (row->tabs->n == 0) editorRowTabsReserve(row, 0);
+    }
+    row->rxoff = 0;
+    return;
+  }
+  if (row->tabs == &tabsNone) {
+    int cap;
+    row->tabs = rowAlloc(sizeof(struct tabIndex), &cap);
+    row->tabs->n = row->tabs->from = row->tabs->shift = row->tabs->rshift = 0;
+    row->tabs->cap = cap;
+    row->tabs->win = NULL;
+  }
+  if (row->tabs->win == NULL) row->tabs->win = calloc(1, sizeof(struct rowWindow));
+  row->tabs->win->in = -1;
+  row->tabs->win->nchk = 0;
+  if (row->render != row->chars) rowFree(row->render, row->rcap);
+  row->render = NULL;
+  row->rcap = 0;
+  row->rsize = 0;
+  row->rxoff = 0;
+  row->nhl = 0;
+  row->gaprx = -1;
+}
+
+// Hands chars a running save still reads to the save, to free when it ends
+void editorSaveKeep(char *chars, int cap) {
+  if (save.nkept == save.keptcap) {
+    save.keptcap = save.keptcap ? save.keptcap * 2 : 64;
+    save.kept = realloc(save.kept, sizeof(struct rowBlock) * save.keptcap);
+  }
+  save.kept[save.nkept].p = chars;
+  save.kept[save.nkept++].cap = cap;
+}
+
+// Gives a row whose chars a running save is writing out a copy of its own,
+// so an edit can't reach the file. The save frees the old chars when it ends.
+void editorRowUnshare(erow *row) {
+  if (!save.active || row->savegen != save.gen) return;
+  editorSaveKeep(row->chars, row->cap);
+  char *chars = rowAlloc(row->cap, &row->cap);
+  memcpy(chars, row->chars, row->cap);
+  row->chars = chars;
+  row->savegen = 0;
+}
+
+// Moves the gap in row->chars to `at`, first growing the buffer (at least
+// doubling it) if the gap has room for fewer than `need` bytes. Every change
+// to a row's text goes through here first.
+void editorRowGapMove(erow *row, int at, int need) {
+  int gaplen = row->cap - 1 - row->size;
+  if (row->render == row->chars && (at != row->gap || gaplen < need)) {
+    // render can't follow chars once the gap moves or the buffer grows: it
+    // gets a copy. Left at the end, the gap only takes edits render can follow.
+    char *render = rowAlloc(row->rsize + 1, &row->rcap);
+    memcpy(render, row->render, row->rsize + 1);
+    row->render = render;
+  }
+  char *chars = row->chars;
+  editorRowUnshare(row);
+  if (row->render == chars) row->render = row->chars;
+  if (gaplen < need) {
+    int cap = row->cap * 2;
+    if (cap < row->size + need + 1) cap = row->size + need + 1;
+    int after = row->size - row->gap;
+    row->chars = rowRealloc(row->chars, row->cap, cap, &cap);
+    memmove(&row->chars[cap - 1 - after], &row->chars[row->cap - 1 - after], after);
+    row->cap = cap;
+    gaplen = cap - 1 - row->size;
+  }
+  if (at < row->gap)
+    memmove(&row->chars[at + gaplen], &row->chars[at], row->gap - at);
+  else if (at > row->gap)
+    memmove(&row->chars[row->gap], &row->chars[row->gap + gaplen], at - row->gap);
+  if (at != row->gap) row->gaprx = (at == row->size) ? row->rsize : -1;
+  row->gap = at;
+}
+
+// Closes the gap so chars holds the text contiguously, null-terminated
+void editorRowFlatten(erow *row) {
+  editorRowGapMove(row, row->size, 0);
+  row->chars[row->size] = '\0';
+}
+
+// Gives a row its own copy of s as chars, with the gap at the end
+void editorRowSetChars(erow *row, char *s, size_t len) {
+  row->size = len;
+  row->gap = len;
+  row->cap = len + 1;
+  row->gaprx = -1;
+  row->savegen = 0;
+  row->chars = rowAlloc(row->cap, &row->cap);
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+}
+
+// Updates the rendered version of a row (expands tabs into spaces)
+
+void editorUpdateRow(erow *row) {
+  editorRowFlatten(row);
+  if (row->render == row->chars) row->render = NULL;  // not to be freed
+  row->hl_in = -1;
+  int tabs = 0;
+  int j;
+  for (j = 0; j < row->size; j++)
+    if (row->chars[j] == '\t') tabs++;
+  int longrow = row->size >= E.longline;
+  if (!longrow) editorRowSetLong(row, 0);
+  editorRowIndexTabs(row, tabs);
+  if (longrow) {
+    editorRowSetLong(row, 1);  // rendered a window at a time when drawn
+    return;
+  }
+  if (tabs == 0) {
+    // render would be a copy of chars, so it is chars
+    rowFree(row->render, row->rcap);
+    row->render = row->chars;
+    row->rcap = 0;
+    row->rsize = row->size;
+    row->gaprx = row->rsize;
+    return;
+  }
+  int rcap = row->size + tabs*(KILO_TAB_STOP - 1) + 1;
+  if (rcap > row->rcap || rcap * 4 < row->rcap) {
+    rowFree(row->render, row->rcap);
+    row->render = rowAlloc(rcap, &row->rcap);
+  }
+  int idx = 0;
+  for (j = 0; j < row->size; j++) {
+    if (row->chars[j] == '\t') {
+      row->render[idx++] = ' ';
+      while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
+    } else {
+      row->render[idx++] = row->chars[j];
+    }
+  }
+  row->render[idx] = '\0';
+  row->rsize = idx;
+  row->gaprx = idx;
+}
+
+// Writes the tab-expanded form of chars [from, to) into render at column rx;
+// returns the column just past it
+int editorRowExpand(erow *row, int from, int to, int rx) {
+  for (int j = from; j < to; j++) {
+    char c = editorRowChar(row, j);
+    if (c == '\t') {
+      row->render[rx++] = ' ';
+      while (rx % KILO_TAB_STOP != 0) row->render[rx++] = ' ';
+    } else {
+      row->render[rx++] = c;
+    }
+  }
+  return rx;
+}
+
+// Brings render and hl up to date after `nins` chars were inserted at `at`, or
+// chars were removed there (nins = 0), leaving the gap just past the edit.
+// rx is the column of `at`, oldrxend the old column just past the edit. Columns
+// after the edit are off by a constant until a tab absorbs the difference, so
+// render is rewritten only up to that tab; if none does, the tail moves with
+// one memmove. Highlighting restarts a token before the edit and stops as soon
+// as it agrees with the old highlighting again.
+void editorRowPatch(int filerow, erow *row, int at, int nins, int rx, int oldrxend) {
+  editorRowPatchTabs(row, at, nins, rx);
+  if (row->tabs && row->tabs->win) {
+    // a long row's window is redone when next drawn
+    editorRowChecksEdit(row, at, nins);
+    row->hl_in = -1;
+    editorSyntaxInvalidate(filerow);
+    return;
+  }
+  if (row->size >= E.longline) {
+    editorUpdateRow(row);  // grown into a long row
+    editorSyntaxInvalidate(filerow);
+    return;
+  }
+  int col = rx;
+  for (int j = at; j < at + nins; j++)
+    col = (editorRowChar(row, j) == '\t') ? (col / KILO_TAB_STOP + 1) * KILO_TAB_STOP : col + 1;
+  int newrxend = col;
+
+  // Walk the unchanged tail tab by tab, tracking its old and new columns
+  char *tail = &row->chars[row->cap - 1 - row->size + row->gap];
+  int j = row->gap;
+  int oldcol = oldrxend;
+  int synced = -1;
+  int tabs = 0;
+  while (j < row->size) {
+    char *tab = memchr(&tail[j - row->gap], '\t', row->size - j);
+    if (tab == NULL) break;
+    int skip = tab - &tail[j - row->gap];
+    col = ((col + skip) / KILO_TAB_STOP + 1) * KILO_TAB_STOP;
+    oldcol = ((oldcol + skip) / KILO_TAB_STOP + 1) * KILO_TAB_STOP;
+    j += skip + 1;
+    tabs++;
+    if (col == oldcol) {
+      synced = col;
+      break;
+    }
+  }
+
+  // hl is patched one type per column, then stored as runs again
+  int newrsize = (synced != -1) ? row->rsize : row->rsize + col - oldcol;
+  unsigned char *hl = NULL;
+  if (row->hl_in != -1) {
+    hl = hlScratch((newrsize > row->rsize ? newrsize : row->rsize) + 1);
+    hlExpand(row, 0, row->rsize, hl);
+  }
+  int end;
+  if (row->render == row->chars && memchr(&row->chars[at], '\t', nins) == NULL) {
+    // an edit at the end of a row without tabs: render is still chars
+    end = newrxend;
+    row->chars[row->size] = '\0';
+    row->rsize = newrsize;
+  } else if (synced != -1) {
+    end = editorRowExpand(row, at, j, rx);
+  } else {
+    if (row->render == row->chars) {
+      // a tab typed at the end of a row without one: render gets the old text
+      char *render = rowAlloc(row->rsize + 1, &row->rcap);
+      memcpy(render, row->chars, row->rsize);
+      render[row->rsize] = '\0';
+      row->render = render;
+    }
+    if (newrsize + 1 > row->rcap) {
+      int rcap = (row->rcap * 2 > newrsize + 1) ? row->rcap * 2 : newrsize + 1;
+      row->render = rowRealloc(row->render, row->rcap, rcap, &row->rcap);
+    }
+    if (tabs == 0) {
+      memmove(&row->render[newrxend], &row->render[oldrxend], row->rsize - oldrxend + 1);
+      if (hl) memmove(&hl[newrxend], &hl[oldrxend], row->rsize - oldrxend);
+      end = editorRowExpand(row, at, at + nins, rx);
+    } else {
+      // tabs moved but never lined up again: the whole tail changes
+      end = editorRowExpand(row, at, row->size, rx);
+      row->render[end] = '\0';
+    }
+    row->rsize = newrsize;
+  }
+  row->gaprx = newrxend;
+
+  // Checkpoints after the row were worked out from its old text
+  editorSyntaxInvalidate(filerow);
+  if (hl == NULL) return;  // highlighted from scratch when drawn
+  if (E.syntax == NULL) {
+    memset(&hl[rx], HL_NORMAL, end - rx);
+  } else {
+    int from = rx - editorSyntaxLookahead();
+    if (from < 0) from = 0;
+    while (from > 0 && !(hl[from - 1] == HL_NORMAL && is_separator(row->render[from - 1])))
+      from--;
+    editorHighlightRow(row, hl, from, (from == 0) ? row->hl_in : 0, end);
+  }
+  hlCompress(row, hl);
+  prof.rehl++;
+}
+
+// Returns row `at`, building its chars and render from the file mapping the
+// first time it is used. hl is filled in when the row is drawn.
+erow *editorRowAt(int at) {
+  erow *row = editorRowPeek(at);
+  if (row->chars == NULL) {
+    editorRowSetChars(row, &E.map[row->foff], row->size);
+    editorUpdateRow(row);
+  }
+  return row;
+}
+
+// Raw bytes of a row without loading it: its own chars (closing the gap if it
+// has one), or its span of the mapping
+char *editorRowData(erow *row) {
+  if (row->chars == NULL) return &E.map[row->foff];
+  if (row == E.gaprow) editorRowFlatten(row);
+  return row->chars;
+}
+
+// Closes the gap of the row being typed into. Needed before rows move around
+// in the tree, since E.gaprow points into a leaf.
+void editorFlattenGapRow(void) {
+  if (E.gaprow) editorRowFlatten(E.gaprow);
+  E.gaprow = NULL;
+}
+
+// Inserts a new row of text into the row tree at position `at`.
+// used for open and newline.
+void editorInsertRow(int at, char *s, size_t len) {
+  if (at < 0 || at > E.numrows) return;
+  editorFlattenGapRow();
+  erow row;
+  row.foff = -1;
+  editorRowSetChars(&row, s, len);
+  row.rsize = 0;
+  row.rcap = 0;
+  row.render = NULL;
+  row.hl = NULL;
+  row.nhl = 0;
+  row.hlcap = 0;
+  row.tabs = NULL;
+  row.rxoff = 0;
+  row.hl_open_comment = 0;
+  editorUpdateRow(&row);
+
+  editorSyntaxRowsMoved(at, 1);
+  rowNode *split = rowTreeInsert(E.rowroot, at, &row);
+  if (split) {
+    rowNode *root = rowNodeNew(0);
+    root->child[0] = E.rowroot;
+    root->child[1] = split;
+    root->n = 2;
+    root->count = E.rowroot->count + split->count;
+    E.rowroot = root;
+  }
+  E.rowleaf = NULL;
+  E.numrows++;
+  E.dirty++;
+}
+
+// Frees memory used by a row
+void editorFreeRow(erow *row) {
+  if (row->render != row->chars) rowFree(row->render, row->rcap);
+  if (save.active && row->savegen == save.gen) editorSaveKeep(row->chars, row->cap);
+  else rowFree(row->chars, row->cap);
+  rowFree(row->hl, row->hlcap);
+  editorRowTabsDrop(row);
+}
+
+// Delete the row at position `at`; rows after it move up by one.
+void editorDelRow(int at) {
+  if (at < 0 || at >= E.numrows) return;
+  editorFlattenGapRow();
+  editorSyntaxRowsMoved(at, -1);
+  erow row;
+  rowTreeDelete(E.rowroot, at, 0, &row);
+  editorFreeRow(&row);
+  while (!E.rowroot->leaf && E.rowroot->n == 1) {
+    rowNode *root = E.rowroot;
+    E.rowroot = root->child[0];
+    rowNodeFree(root);
+  }
+  if (!E.rowroot->leaf && E.rowroot->n == 0) {
+    rowNodeFree(E.rowroot);
+    E.rowroot = rowNodeNew(1);
+  }
+  E.rowleaf = NULL;
+  E.numrows--;
+  E.dirty++;
+}
+
+// Makes row the one whose gap may sit mid-text, closing the previous one's
+void editorRowTakeGap(erow *row) {
+  if (E.gaprow == row) return;
+  editorFlattenGapRow();
+  E.gaprow = row;
+}
+
+// Insert character c at position at inside row `filerow`. The gap follows the
+// cursor, so typing only writes into it.
+void editorRowInsertChar(int filerow, int at, int c) {
+  erow *row = editorRowAt(filerow);
+  if (at < 0 || at > row->size) at = row->size;
+  editorRowTakeGap(row);
+  int rx = editorRowCxToRx(row, at);
+  editorRowGapMove(row, at, 1);
+  row->chars[row->gap++] = c;
+  row->size++;
+  row->foff = -1;
+  editorRowPatch(filerow, row, at, 1, rx, rx);
+  E.dirty++;
+}
+
+// Insert len bytes of s at position at inside row `filerow`, in one edit
+void editorRowInsertString(int filerow, int at, char *s, int len) {
+  if (len == 0) return;
+  erow *row = editorRowAt(filerow);
+  if (at < 0 || at > row->size) at = row->size;
+  editorRowTakeGap(row);
+  int rx = editorRowCxToRx(row, at);
+  editorRowGapMove(row, at, len);
+  memcpy(&row->chars[row->gap], s, len);
+  row->gap += len;
+  row->size += len;
+  row->foff = -1;
+  editorRowPatch(filerow, row, at, len, rx, rx);
+  E.dirty++;
+}
+
+// Delete character at `at` inside row `filerow`
+void editorRowDelChar(int filerow, int at) {
+  erow *row = editorRowAt(filerow);
+  if (at < 0 || at >= row->size) return;
+  editorRowTakeGap(row);
+  int oldrxend = editorRowCxToRx(row, at + 1);
+  int rx = (editorRowChar(row, at) == '\t') ? editorRowCxToRx(row, at) : oldrxend - 1;
+  editorRowGapMove(row, at + 1, 0);
+  row->gap--;
+  row->size--;
+  row->foff = -1;
+  editorRowPatch(filerow, row, at, 0, rx, oldrxend);
+  E.dirty++;
+}
+
+// Append a c-string of length len to the end of row `filerow`
+void editorRowAppendString(int filerow, char *s, size_t len) {
+  erow *row = editorRowAt(filerow);
+  editorRowGapMove(row, row->size, len);
+  memcpy(&row->chars[row->size], s, len);
+  row->size += len;
+  row->gap = row->size;
+  row->foff = -1;
+  row->chars[row->size] = '\0';
+  editorUpdateRow(row);
+  editorSyntaxInvalidate(filerow);
+  E.dirty++;
+}
+
+/*** editor operations ***/
+
+// Insert a character at the current cursor position, creating a row if needed
+void editorInsertChar(int c) {
+  if (E.cy == E.numrows) {
+    // we're at a new line after the last row; insert an empty row
+    editorInsertRow(E.numrows, "", 0);
+  }
+  editorRowInsertChar(E.cy, E.cx, c);
+  E.cx++;
+}
+
+// Insert a newline at the current cursor position: split current row or insert empty row
+void editorInsertNewline(void) {
+  if (E.cx == 0) {
+    // cursor at start — insert empty row at current position
+    editorInsertRow(E.cy, "", 0);
+  } else {
+    // split current row at cursor
+    erow *row = editorRowAt(E.cy);
+    editorRowFlatten(row);
+    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+    row = editorRowAt(E.cy);
+    row->size = E.cx;
+    row->gap = E.cx;
+    row->foff = -1;
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+  }
+  E.cy++;
+  E.cx = 0;
+}
+
+// Returns the length of the line break at s (\n, \r or \r\n), 0 if none
+int editorLineBreak(char *s, int len) {
+  if (len == 0) return 0;
+  if (*s == '\n') return 1;
+  if (*s == '\r') return (len > 1 && s[1] == '\n') ? 2 : 1;
+  return 0;
+}
+
+// Insert a block of text (a paste) at the cursor. The current row is split
+// once, the text's lines go in as whole rows, and the cursor ends up after it.
+void editorInsertText(char *s, int len) {
+  if (E.cy == E.numrows) editorInsertRow(E.numrows, "", 0);
+  int j = 0;
+  while (j < len && !editorLineBreak(&s[j], len - j)) j++;
+  editorRowInsertString(E.cy, E.cx, s, j);
+  E.cx += j;
+  if (j == len) return;
+
+  // cut what follows the cursor; it goes on the end of the last line
+  erow *row = editorRowAt(E.cy);
+  editorRowFlatten(row);
+  int taillen = row->size - E.cx;
+  char *tail = malloc(taillen);
+  memcpy(tail, &row->chars[E.cx], taillen);
+  row->size = E.cx;
+  row->gap = E.cx;
+  row->foff = -1;
+  row->chars[row->size] = '\0';
+  editorUpdateRow(row);
+  editorSyntaxInvalidate(E.cy);
+
+  while (j < len) {
+    j += editorLineBreak(&s[j], len - j);
+    int start = j;
+    while (j < len && !editorLineBreak(&s[j], len - j)) j++;
+    E.cy++;
+    if (j < len) {
+      editorInsertRow(E.cy, &s[start], j - start);
+    } else {
+      char *last = malloc(j - start + taillen);
+      memcpy(last, &s[start], j - start);
+      memcpy(&last[j - start], tail, taillen);
+      editorInsertRow(E.cy, last, j - start + taillen);
+      free(last);
+    }
+    E.cx = j - start;
+  }
+  free(tail);
+}
+
+// Delete a character at the cursor (backspace behavior)
+// if at start of line, append this row into previous and delete the row.
+void editorDelChar(void) {
+  if (E.cy == E.numrows) return;
+  if (E.cx == 0 && E.cy == 0) return;
+
+  erow *row = editorRowAt(E.cy);
+  if (E.cx > 0) {
+    editorRowDelChar(E.cy, E.cx - 1);
+    E.cx--;
+  } else {
+    // join this line with previous
+    int prev_len = editorRowPeek(E.cy - 1)->size;
+    editorRowFlatten(row);
+    editorRowAppendString(E.cy - 1, row->chars, row->size);
+    editorDelRow(E.cy);
+    E.cy--;
+    E.cx = prev_len;
+  }
+}
+
+/*** file I/O ***/
+
+// Rows being saved, gathered into batches for writev(). Pieces that follow on
+// from each other in memory, like the unedited lines of the mapping, are
+// joined into one.
+struct saveBuf {
+  int fd;
+  struct iovec iov[KILO_SAVE_IOV];
+  int n;
+  off_t written;          // Bytes gathered so far, written or not
+  int failed;             // 1 once a write has failed; errno says why
+  int nocopy;             // 1 once copy_file_range() has turned out not to work here
+};
+
+// Writes n pieces with writev(), going on after short writes
+void saveWritev(struct saveBuf *sb, struct iovec *iov, int n) {
+  while (n > 0 && !sb->failed) {
+    ssize_t w = writev(sb->fd, iov, n);
+    if (w == -1) {
+      if (errno != EINTR) sb->failed = 1;
+      continue;
+    }
+    while (n > 0 && (size_t)w >= iov->iov_len) {
+      w -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+}
+
+// Copies len bytes of the mapping at p to the file with copy_file_range(): the
+// kernel moves them without a trip through user space, and filesystems that
+// can share extents between files don't copy them at all. Whatever can't be
+// copied that way (other filesystems, old kernels) is written instead.
+void saveCopy(struct saveBuf *sb, char *p, size_t len) {
+  loff_t in = p - E.map;
+  while (len > 0 && !sb->nocopy && !sb->failed) {
+    ssize_t c = copy_file_range(E.mapfd, &in, sb->fd, NULL, len, 0);
+    if (c > 0) {
+      p += c;
+      len -= c;
+    } else if (c == 0 || errno != EINTR) {
+      sb->nocopy = 1;  // a real I/O error shows up again in the write
+    }
+  }
+  struct iovec iov = {p, len};
+  if (len > 0) saveWritev(sb, &iov, 1);
+}
+
+// Writes out the gathered pieces. Long runs of the mapping, the text nobody
+// edited, are copied from the file rather than written.
+int saveFlush(struct saveBuf *sb) {
+  int from = 0;
+  for (int k = 0; k < sb->n; k++) {
+    char *p = sb->iov[k].iov_base;
+    if (sb->nocopy || sb->iov[k].iov_len < KILO_SAVE_COPY || p < E.map || p >= E.map + E.mapsize)
+      continue;
+    saveWritev(sb, &sb->iov[from], k - from);
+    saveCopy(sb, p, sb->iov[k].iov_len);
+    from = k + 1;
+  }
+  saveWritev(sb, &sb->iov[from], sb->n - from);
+  sb->n = 0;
+  return sb->failed ? -1 : 0;
+}
+
+void saveAppend(struct saveBuf *sb, const char *p, size_t len) {
+  sb->written += len;
+  if (sb->n > 0) {
+    struct iovec *last = &sb->iov[sb->n - 1];
+    if ((char *)last->iov_base + last->iov_len == p) {
+      last->iov_len += len;
+      return;
+    }
+  }
+  if (sb->n == KILO_SAVE_IOV) saveFlush(sb);
+  sb->iov[sb->n].iov_base = (char *)p;
+  sb->iov[sb->n].iov_len = len;
+  sb->n++;
+}
+
+// Appends a row's text and its '\n'. Text in the mapping brings its own '\n'
+// along when it has one, so runs of lines go out as a single piece.
+void saveAppendRow(struct saveBuf *sb, const char *s, off_t len) {
+  static const char newline = '\n';
+  if (s >= E.map && s + len < E.map + E.mapsize && s[len] == '\n') {
+    saveAppend(sb, s, len + 1);
+  } else {
+    saveAppend(sb, s, len);
+    saveAppend(sb, &newline, 1);
+  }
+}
+
+// Takes the snapshot a save writes out: a lazy leaf as its range of lines, any
+// other row as the text it has now. Nothing is copied: unedited rows are spans
+// of the mapping, and edited ones are marked as sharing their chars with the
+// save instead.
+void editorSaveSnapshot(void) {
+  save.gen++;
+  save.nleaves = 0;
+  save.total = 0;
+  for (int at = 0; at < E.numrows;) {
+    int base;
+    rowNode *leaf = rowTreeSeek(at, &base);
+    if (save.nleaves == save.leafcap) {
+      save.leafcap = save.leafcap ? save.leafcap * 2 : 256;
+      save.leaves = realloc(save.leaves, sizeof(struct saveLeaf) * save.leafcap);
+    }
+    struct saveLeaf *sl = &save.leaves[save.nleaves++];
+    sl->lazy = leaf->lazy;
+    sl->n = leaf->n;
+    sl->rows = NULL;
+    if (leaf->lazy != -1) {
+      save.total += E.lineoff[leaf->lazy + leaf->n] - E.lineoff[leaf->lazy];
+    } else {
+      sl->rows = malloc(sizeof(struct saveRow) * leaf->n);
+      for (int j = 0; j < leaf->n; j++) {
+        erow *row = &leaf->rows[j];
+        struct saveRow *sr = &sl->rows[j];
+        if (row->foff != -1) {  // unloaded, or loaded and still the file's text
+          sr->head = &E.map[row->foff];
+          sr->headlen = row->size;
+          sr->tail = NULL;
+          sr->taillen = 0;
+        } else {
+          sr->head = row->chars;
+          sr->headlen = row->gap;
+          sr->tail = &row->chars[row->cap - 1 - row->size + row->gap];
+          sr->taillen = row->size - row->gap;
+          row->savegen = save.gen;
+        }
+        save.total += row->size + 1;
+      }
+    }
+    at = base + leaf->n;
+  }
+}
+
+// Frees the snapshot, and the chars edits took away from it
+void editorSaveRelease(void) {
+  for (int k = 0; k < save.nleaves; k++) free(save.leaves[k].rows);
+  free(save.leaves);
+  save.leaves = NULL;
+  save.nleaves = save.leafcap = 0;
+  for (int k = 0; k < save.nkept; k++) rowFree(save.kept[k].p, save.kept[k].cap);
+  free(save.kept);
+  save.kept = NULL;
+  save.nkept = save.keptcap = 0;
+}
+
+// Streams the snapshot to fd, keeping save.progress up to date. Lazy leaves
+// are read straight from the mapping, without building their rows. Only the
+// snapshot, the mapping and the line index are read, none of which change
+// while a save runs, so this is safe on the writer thread. Returns the bytes
+// written, or -1.
+off_t saveWriteSnapshot(int fd) {
+  struct saveBuf sb;
+  sb.fd = fd;
+  sb.n = 0;
+  sb.written = 0;
+  sb.failed = 0;
+  sb.nocopy = 0;
+  for (int k = 0; k < save.nleaves && !sb.failed; k++) {
+    struct saveLeaf *sl = &save.leaves[k];
+    for (int j = 0; j < sl->n; j++) {
+      if (sl->rows == NULL) {
+        off_t start = E.lineoff[sl->lazy + j];
+        off_t end = E.lineoff[sl->lazy + j + 1] - 1;
+        while (end > start && E.map[end - 1] == '\r') end--;
+        saveAppendRow(&sb, &E.map[start], end - start);
+      } else {
+        struct saveRow *sr = &sl->rows[j];
+        if (sr->taillen == 0) {
+          saveAppendRow(&sb, sr->head, sr->headlen);
+        } else {
+          saveAppend(&sb, sr->head, sr->headlen);
+          saveAppendRow(&sb, sr->tail, sr->taillen);
+        }
+      }
+    }
+    __atomic_store_n(&save.progress, sb.written, __ATOMIC_RELAXED);
+  }
+  saveFlush(&sb);
+  return sb.failed ? -1 : sb.written;
+}
+
+// Streams every row to fd in the foreground. Returns the bytes written, or -1.
+off_t editorWriteRows(int fd) {
+  editorSaveSnapshot();
+  off_t len = saveWriteSnapshot(fd);
+  editorSaveRelease();
+  return len;
+}
+
+// Maps a regular file read-only into E.map. Returns -1 if it can't be mapped.
+int editorMapFile(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) return -1;
+  E.map = NULL;
+  E.mapsize = st.st_size;
+  if (E.mapsize == 0) return 0;
+  char *map = mmap(NULL, E.mapsize, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) return -1;
+  E.map = map;
+  return 0;
+}
+
+// Records the start offset of every line of the mapping in E.lineoff and
+// builds the row tree over it. Rows are filled in by the tree as they are used.
+void editorIndexRows(void) {
+  size_t cap = 1024;
+  size_t off = 0;
+  E.lineoff = malloc(sizeof(off_t) * cap);
+  madvise(E.map, E.mapsize, MADV_SEQUENTIAL);
+  while (off < E.mapsize) {
+    if ((size_t)E.numrows + 2 > cap) {
+      cap *= 2;
+      E.lineoff = realloc(E.lineoff, sizeof(off_t) * cap);
+    }
+    E.lineoff[E.numrows++] = off;
+    char *nl = memchr(&E.map[off], '\n', E.mapsize - off);
+    off = nl ? (size_t)(nl - E.map) + 1 : E.mapsize + 1;  // as if a '\n' followed the last line
+  }
+  E.lineoff[E.numrows] = off;
+  madvise(E.map, E.mapsize, MADV_NORMAL);
+  rowTreeBuild();
+}
+
+// Once the saved file has replaced the old one, maps it and points every row
+// at its text there, edited or not. The line index is rebuilt in place of the
+// old one, one line per row, so lazy leaves become lines [base, base+n):
+// loaded leaves know their rows' lengths, lazy ones find their '\n's. fd is
+// kept open as E.mapfd. If the file can't be mapped, fd is closed and rows
+// keep using the old mapping, whose file lives on while it's mapped.
+void editorRemapAfterSave(int fd) {
+  char *oldmap = E.map;
+  size_t oldsize = E.mapsize;
+  if (editorMapFile(fd) == -1) {
+    E.map = oldmap;
+    E.mapsize = oldsize;
+    close(fd);
+    return;
+  }
+  if (oldmap) munmap(oldmap, oldsize);
+  if (E.mapfd != -1) close(E.mapfd);
+  E.mapfd = fd;
+  free(E.lineoff);
+  E.lineoff = malloc(sizeof(off_t) * (E.numrows + 1));
+  off_t off = 0;
+  for (int at = 0; at < E.numrows;) {
+    int base;
+    rowNode *leaf = rowTreeSeek(at, &base);
+    for (int j = 0; j < leaf->n; j++) {
+      E.lineoff[base + j] = off;
+      if (leaf->lazy != -1) {
+        off = (char *)memchr(&E.map[off], '\n', E.mapsize - off) - E.map + 1;
+      } else {
+        erow *row = &leaf->rows[j];
+        row->foff = off;
+        off += row->size + 1;
+      }
+    }
+    if (leaf->lazy != -1) leaf->lazy = base;
+    at = base + leaf->n;
+  }
+  E.lineoff[E.numrows] = off;
+}
+
+// Gives a file about to replace target the permissions (and, when allowed,
+// the owner) of target, or those of a new file if there's no target yet
+void editorSaveMode(int fd, const char *target) {
+  struct stat st;
+  if (stat(target, &st) == 0) {
+    fchmod(fd, st.st_mode & 07777);
+    if (fchown(fd, st.st_uid, st.st_gid) == -1) {
+      // only root can give a file away; keeping our own ownership is fine
+    }
+  } else {
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0644 & ~mask);
+  }
+}
+
+// Flushes the directory holding path, so a rename into it is on disk too
+void editorSyncDir(const char *path) {
+  char *dir = strdup(path);
+  char *slash = strrchr(dir, '/');
+  if (slash == dir) slash[1] = '\0';
+  else if (slash) *slash = '\0';
+  else strcpy(dir, ".");
+  int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (fd != -1) {
+    fsync(fd);
+    close(fd);
+  }
+  free(dir);
+}
+
+// Opens a file. Regular files are memory-mapped and indexed; anything else
+// (pipes, devices) is read line by line.
+void editorOpen(char *filename) {
+  long t = profBegin();
+  free(E.filename);
+  E.filename = strdup(filename);
+
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) die("open");
+
+  if (editorMapFile(fd) == 0) {
+    editorIndexRows();
+    E.mapfd = fd;
+  } else {
+    E.mapfd = -1;
+    FILE *fp = fdopen(fd, "r");
+    if (!fp) die("fdopen");
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+
+    while ((linelen = getline(&line, &linecap, fp)) != -1) {
+      while (linelen > 0 && (line[linelen - 1] == '\n' ||
+                             line[linelen - 1] == '\r'))
+        linelen--;
+      editorInsertRow(E.numrows, line, linelen);
+    }
+
+    free(line);
+    fclose(fp);
+  }
+  E.dirty = 0;
+  editorSelectSyntaxHighlight();
+  profEnd(t, "editorOpen", "rows", E.numrows);
+}
+
+// The writer of a background save: writes the snapshot to the temporary file,
+// makes sure it's on disk and moves it over the target, then wakes the event
+// loop to finish up
+void *editorSaveThread(void *arg) {
+  (void)arg;
+  off_t len = saveWriteSnapshot(save.fd);
+  if (len != -1 && (fsync(save.fd) == -1 || rename(save.tmp, save.target) == -1)) len = -1;
+  save.err = errno;
+  if (len != -1) editorSyncDir(save.target);
+  save.len = len;
+  if (save.profstart) save.profend = profNow();
+  if (write(save.done[1], "s", 1) == -1) {}  // the pipe is new and empty
+  return NULL;
+}
+
+// Percentage of a running save written so far
+int editorSavePercent(void) {
+  off_t done = __atomic_load_n(&save.progress, __ATOMIC_RELAXED);
+  if (save.total == 0) return 0;
+  int pct = done * 100 / save.total;
+  return pct > 99 ? 99 : pct;
+}
+
+// Wraps up a background save once its writer is done. Edits made since the
+// snapshot aren't in the file, so they keep the buffer modified; an unedited
+// buffer is its file again, line for row, and moves onto the new mapping.
+void editorSaveFinish(void) {
+  if (save.threaded) pthread_join(save.thread, NULL);
+  if (save.profstart) profRecord("save writer", save.profstart, save.profend, 2, "bytes", save.len);
+  close(save.done[0]);
+  close(save.done[1]);
+  save.active = 0;
+  editorSaveRelease();
+  if (save.len == -1) {
+    close(save.fd);
+    unlink(save.tmp);
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(save.err));
+  } else {
+    E.dirty -= save.dirty;
+    if (E.dirty == 0) editorRemapAfterSave(save.fd);
+    else close(save.fd);
+    if (E.dirty)
+      editorSetStatusMessage("%lld bytes written to disk, without edits made while saving", (long long)save.len);
+    else
+      editorSetStatusMessage("%lld bytes written to disk", (long long)save.len);
+  }
+  free(save.tmp);
+  free(save.target);
+  E.redraw = 1;
+}
+
+// Blocks until a running save is done, and finishes it
+void editorSaveWait(void) {
+  if (save.active) editorSaveFinish();
+}
+
+// Save buffer to disk. If no filename, prompt user (editorPrompt)
+void editorSave() {
+  if (save.active) {
+    editorSetStatusMessage("Already saving (%d%%)", editorSavePercent());
+    return;
+  }
+  if (E.filename == NULL) {
+    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+    if (E.filename == NULL) {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+    editorSelectSyntaxHighlight();
+  }
+  long t = profBegin();
+  // Write the rows to a new file next to the real one (not next to a symlink
+  // to it), make sure it's on disk, then move it over the old file: a crash
+  // leaves either the old file or the new one, never half of each. The
+  // writing happens on a thread of its own, from a snapshot of the rows, so
+  // editing can go on meanwhile; editorWaitKey finishes the save.
+  char *target = realpath(E.filename, NULL);
+  if (target == NULL) target = strdup(E.filename);
+  char *tmp = malloc(strlen(target) + 8);
+  sprintf(tmp, "%s.XXXXXX", target);
+  int fd = mkstemp(tmp);
+  if (fd == -1 || pipe(save.done) == -1) {
+    int err = errno;
+    if (fd != -1) {
+      close(fd);
+      unlink(tmp);
+    }
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(err));
+    free(tmp);
+    free(target);
+    profEnd(t, "editorSave", NULL, 0);
+    return;
+  }
+  editorSaveMode(fd, target);
+  editorSaveSnapshot();
+  save.fd = fd;
+  save.tmp = tmp;
+  save.target = target;
+  save.dirty = E.dirty;
+  save.progress = 0;
+  save.active = 1;
+  save.profstart = t ? profNow() : 0;
+  save.threaded = pthread_create(&save.thread, NULL, editorSaveThread, NULL) == 0;
+  if (!save.threaded) editorSaveThread(NULL);
+  profEnd(t, "editorSave", "bytes", save.total);
+}
+
+/*** regex ***/
+
+// Search patterns: literal bytes, ., [classes] with ranges and ^, the escapes
+// \d \w \s and their capitals, (groups), |, *, +, ? and {m,n}, and ^ and $ at
+// the very start and end (anywhere else they are plain bytes). A pattern is
+// parsed into a tree, which is emitted twice as an NFA: once to read rows
+// forwards, once to read them backwards. Each NFA runs as a DFA built a state
+// at a time as bytes are read, so matching a row takes time linear in its
+// length however the pattern is written.
+
+enum reNodeOp { RE_EMPTY, RE_SET, RE_CAT, RE_ALT, RE_REPEAT };
+
+// A node of the parsed pattern
+struct reNode {
+  int op;
+  int a, b;               // Children: both for RE_CAT and RE_ALT, a for RE_REPEAT
+  int min, max;           // RE_REPEAT bounds, max -1 if there is none
+  int set;                // RE_SET: index of the byte set it reads
+};
+
+enum reInstOp { RI_SET, RI_SPLIT, RI_MATCH };
+
+// An NFA instruction. RI_SET reads a byte of its set and goes on to out,
+// RI_SPLIT goes on to both out and out1 without reading, RI_MATCH accepts.
+struct reInst {
+  int op;
+  int out, out1;
+  int set;
+};
+
+// A compiled pattern. Read-only once compiled, so threads may share it.
+struct regex {
+  struct reNode *node;
+  int nnode, nodecap;
+  unsigned char (*sets)[32];  // A bit per byte
+  int nsets, setcap;
+  struct reInst *inst;
+  int ninst, instcap;
+  int start[2];           // First instruction reading forwards and backwards
+  int bol, eol;           // 1 if the pattern is anchored by ^ or $
+  int icase;              // 1 if sets hold both cases of every letter
+  unsigned char cls[256]; // Byte classes: bytes no set tells apart share one
+  unsigned char clsbyte[256]; // A byte of each class
+  int nclass;
+  char lit[64];           // Longest run of literal bytes every match holds (folded)
+  int litlen;
+  const char *err;        // What's wrong with the pattern, while compiling
+  int depth;              // ( )s the parser is inside, while compiling
+  int barealt;            // 1 if a | lies outside every ( ), while compiling
+};
+
+// One direction of a pattern run as a lazily built DFA. A state is the sorted
+// list of RI_SET and RI_MATCH instructions the NFA can be at; its move on each
+// byte class is worked out the first time that class is read in it. When the
+// cache is full it's dropped and rebuilt from the states in use, which keeps
+// memory bounded without giving up linear time.
+struct reDfa {
+  const struct regex *re;
+  int dir;                // 0 reads forwards, 1 backwards
+  int floating;           // 1 if a match may start at any byte (not anchored)
+  int nstates, cap;
+  int *listoff, *listlen; // Each state's instructions, in list
+  int *list;
+  int listused, listcap;
+  int *next;              // Row of a state (state * nclass) + class -> row of the next state, -1 if not known yet
+  unsigned char *flags;   // RE_ACCEPT and RE_DEAD, at the row of each state
+  int hash[REGEX_DFA_STATES * 2];  // State + 1 by hash of its list, 0 if free
+  int *mark;              // Scratch for closures, one per instruction
+  int gen;
+  int *work;
+  int flushes;            // Times the cache was dropped
+  int start;              // The state before any byte is read, -1 if not known
+};
+
+static inline int reSetHas(const struct regex *re, int set, unsigned char c) {
+  return re->sets[set][c >> 3] & (1 << (c & 7));
+}
+
+int reNodeNew(struct regex *re, int op, int a, int b) {
+  if (re->nnode == re->nodecap) {
+    re->nodecap = re->nodecap ? re->nodecap * 2 : 32;
+    re->node = realloc(re->node, sizeof(struct reNode) * re->nodecap);
+  }
+  struct reNode *n = &re->node[re->nnode];
+  n->op = op;
+  n->a = a;
+  n->b = b;
+  n->min = n->max = 0;
+  n->set = -1;
+  return re->nnode++;
+}
+
+// A new RE_SET node with an empty set
+int reSetNew(struct regex *re) {
+  if (re->nsets == re->setcap) {
+    re->setcap = re->setcap ? re->setcap * 2 : 16;
+    re->sets = realloc(re->sets, sizeof(re->sets[0]) * re->setcap);
+  }
+  memset(re->sets[re->nsets], 0, sizeof(re->sets[0]));
+  int n = reNodeNew(re, RE_SET, -1, -1);
+  re->node[n].set = re->nsets++;
+  return n;
+}
+
+// Adds byte c to the set, in both cases when ignoring case
+void reSetAdd(struct regex *re, int set, unsigned char c) {
+  re->sets[set][c >> 3] |= 1 << (c & 7);
+  if (re->icase && (c | 0x20) >= 'a' && (c | 0x20) <= 'z') {
+    c ^= 0x20;
+    re->sets[set][c >> 3] |= 1 << (c & 7);
+  }
+}
+
+// Adds the bytes of class escape \c (d, w, s or a capital for the rest) to the
+// set. Returns 0 if c isn't a class escape.
+int reSetAddEscape(struct regex *re, int set, char c) {
+  int lower = c | 0x20;
+  if (lower != 'd' && lower != 'w' && lower != 's') return 0;
+  for (int b = 0; b < 256; b++) {
+    int in = (lower == 'd') ? (b >= '0' && b <= '9')
+           : (lower == 'w') ? (isalnum(b) || b == '_')
+           : (b == ' ' || (b >= '\t' && b <= '\r'));
+    if (in != (c != lower)) reSetAdd(re, set, b);
+  }
+  return 1;
+}
+
+// Parsing: each function reads from *p and returns the node it built, or -1
+// with re->err set
+int reParseAlt(struct regex *re, const char **p, const char *end);
+
+int reParseClass(struct regex *re, const char **p, const char *end) {
+  int n = reSetNew(re);
+  int set = re->node[n].set;
+  int negate = (*p < end && **p == '^');
+  if (negate) (*p)++;
+  int first = 1;
+  while (*p < end && (**p != ']' || first)) {
+    first = 0;
+    unsigned char c = *(*p)++;
+    if (c == '\\') {
+      if (*p == end) break;
+      c = *(*p)++;
+      if (reSetAddEscape(re, set, c)) continue;
+      if (c == 't') c = '\t';
+    }
+    if (*p + 1 < end && **p == '-' && (*p)[1] != ']') {
+      unsigned char hi = (*p)[1];
+      *p += 2;
+      if (hi == '\\' && *p < end) hi = *(*p)++;
+      if (hi < c) {
+        re->err = "bad range";
+        return -1;
+      }
+      for (int b = c; b <= hi; b++) reSetAdd(re, set, b);
+    } else {
+      reSetAdd(re, set, c);
+    }
+  }
+  if (*p == end) {
+    re->err = "missing ]";
+    return -1;
+  }
+  (*p)++;
+  if (negate)
+    for (int k = 0; k < 32; k++) re->sets[set][k] = ~re->sets[set][k];
+  return n;
+}
+
+int reParseAtom(struct regex *re, const char **p, const char *end) {
+  char c = *(*p)++;
+  if (c == '(') {
+    re->depth++;
+    int n = reParseAlt(re, p, end);
+    re->depth--;
+    if (n == -1) return -1;
+    if (*p == end || **p != ')') {
+      re->err = "missing )";
+      return -1;
+    }
+    (*p)++;
+    return n;
+  }
+  if (c == '[') return reParseClass(re, p, end);
+  if (c == '*' || c == '+' || c == '?' || c == '{') {
+    re->err = "nothing to repeat";
+    return -1;
+  }
+  int n = reSetNew(re);
+  int set = re->node[n].set;
+  if (c == '.') {
+    memset(re->sets[set], 0xff, sizeof(re->sets[0]));
+  } else if (c == '\\') {
+    if (*p == end) {
+      re->err = "trailing \\";
+      return -1;
+    }
+    c = *(*p)++;
+    if (!reSetAddEscape(re, set, c)) reSetAdd(re, set, c == 't' ? '\t' : c);
+  } else {
+    reSetAdd(re, set, c);
+  }
+  return n;
+}
+
+// Reads the number at *p, up to REGEX_MAX_REPEAT; -1 if there isn't one
+int reParseCount(const char **p, const char *end) {
+  if (*p == end || !isdigit((unsigned char)**p)) return -1;
+  int v = 0;
+  while (*p < end && isdigit((unsigned char)**p)) {
+    v = v * 10 + (*(*p)++ - '0');
+    if (v > REGEX_MAX_REPEAT) return REGEX_MAX_REPEAT + 1;
+  }
+  return v;
+}
+
+int reParseRepeat(struct regex *re, const char **p, const char *end) {
+  int n = reParseAtom(re, p, end);
+  while (n != -1 && *p < end && strchr("*+?{", **p)) {
+    int min = 0, max = -1;
+    char c = *(*p)++;
+    if (c == '+') min = 1;
+    if (c == '?') max = 1;
+    if (c == '{') {
+      min = reParseCount(p, end);
+      max = min;
+      if (*p < end && **p == ',') {
+        (*p)++;
+        max = (*p < end && **p == '}') ? -1 : reParseCount(p, end);
+      }
+      if (min == -1 || (max != -1 && max < min) || *p == end || **p != '}') {
+        re->err = "bad {m,n}";
+        return -1;
+      }
+      if (min > REGEX_MAX_REPEAT || max > REGEX_MAX_REPEAT) {
+        re->err = "repeat too large";
+        return -1;
+      }
+      (*p)++;
+    }
+    int r = reNodeNew(re, RE_REPEAT, n, -1);
+    re->node[r].min = min;
+    re->node[r].max = max;
+    n = r;
+  }
+  return n;
+}
+
+int reParseCat(struct regex *re, const char **p, const char *end) {
+  int n = reNodeNew(re, RE_EMPTY, -1, -1);
+  while (*p < end && **p != '|' && **p != ')') {
+    int r = reParseRepeat(re, p, end);
+    if (r == -1) return -1;
+    n = (re->node[n].op == RE_EMPTY) ? r : reNodeNew(re, RE_CAT, n, r);
+  }
+  return n;
+}
+
+int reParseAlt(struct regex *re, const char **p, const char *end) {
+  int n = reParseCat(re, p, end);
+  while (n != -1 && *p < end && **p == '|') {
+    if (re->depth == 0) re->barealt = 1;
+    (*p)++;
+    int r = reParseCat(re, p, end);
+    n = (r == -1) ? -1 : reNodeNew(re, RE_ALT, n, r);
+  }
+  return n;
+}
+
+int reInstNew(struct regex *re, int op, int out, int out1, int set) {
+  if (re->ninst == re->instcap) {
+    re->instcap = re->instcap ? re->instcap * 2 : 64;
+    re->inst = realloc(re->inst, sizeof(struct reInst) * re->instcap);
+  }
+  re->inst[re->ninst] = (struct reInst){op, out, out1, set};
+  return re->ninst++;
+}
+
+// Emits node n reading in direction dir, continuing to instruction next, and
+// returns its first instruction. Bounded repeats are emitted copy by copy.
+int reEmit(struct regex *re, int n, int next, int dir) {
+  if (re->ninst > REGEX_MAX_INST) return next;
+  struct reNode nd = re->node[n];
+  switch (nd.op) {
+    case RE_SET:
+      return reInstNew(re, RI_SET, next, -1, nd.set);
+    case RE_CAT:
+      return dir ? reEmit(re, nd.b, reEmit(re, nd.a, next, dir), dir)
+                 : reEmit(re, nd.a, reEmit(re, nd.b, next, dir), dir);
+    case RE_ALT: {
+      int a = reEmit(re, nd.a, next, dir);
+      return reInstNew(re, RI_SPLIT, a, reEmit(re, nd.b, next, dir), -1);
+    }
+    case RE_REPEAT: {
+      int k = next;
+      if (nd.max == -1) {
+        k = reInstNew(re, RI_SPLIT, -1, next, -1);
+        int body = reEmit(re, nd.a, k, dir);
+        re->inst[k].out = body;
+      }
+      for (int i = nd.min; i < nd.max; i++)
+        k = reInstNew(re, RI_SPLIT, reEmit(re, nd.a, k, dir), next, -1);
+      for (int i = 0; i < nd.min; i++) k = reEmit(re, nd.a, k, dir);
+      return k;
+    }
+  }
+  return next;
+}
+
+// Splits the bytes into classes no set tells apart, so DFA states need a
+// transition per class rather than per byte
+void reClasses(struct regex *re) {
+  memset(re->cls, 0, sizeof(re->cls));
+  re->nclass = 1;
+  for (int s = 0; s < re->nsets; s++) {
+    int split[512];
+    int n = 0;
+    for (int k = 0; k < 512; k++) split[k] = -1;
+    for (int c = 0; c < 256; c++) {
+      int k = re->cls[c] * 2 + (reSetHas(re, s, c) != 0);
+      if (split[k] == -1) split[k] = n++;
+      re->cls[c] = split[k];
+    }
+    re->nclass = n;
+  }
+  for (int c = 255; c >= 0; c--) re->clsbyte[re->cls[c]] = c;
+}
+
+// The byte a set stands for as a literal (folded when ignoring case), or -1
+int reSetLiteral(const struct regex *re, int set) {
+  int count = 0, byte = -1;
+  for (int c = 0; c < 256; c++)
+    if (reSetHas(re, set, c)) {
+      count++;
+      if (byte == -1) byte = c;
+    }
+  if (count == 1) return byte;
+  if (count == 2 && re->icase && byte >= 'A' && byte <= 'Z' && reSetHas(re, set, byte | 0x20))
+    return byte | 0x20;
+  return -1;
+}
+
+// Finds the longest run of literal bytes among the pieces of the pattern's
+// top-level concatenation: a row without it can't match, and looking for it
+// is the fast substring search
+void reLiteral(struct regex *re, int n, char *run, int *runlen) {
+  struct reNode *nd = &re->node[n];
+  int c = (nd->op == RE_SET) ? reSetLiteral(re, nd->set) : -1;
+  if (nd->op == RE_CAT) {
+    reLiteral(re, nd->a, run, runlen);
+    reLiteral(re, nd->b, run, runlen);
+    return;
+  }
+  if (c == -1 || *runlen == (int)sizeof(re->lit)) {
+    *runlen = 0;
+    return;
+  }
+  run[(*runlen)++] = c;
+  if (*runlen > re->litlen) {
+    re->litlen = *runlen;
+    memcpy(re->lit, run, *runlen);
+  }
+}
+
+void regexFree(struct regex *re) {
+  if (re == NULL) return;
+  free(re->node);
+  free(re->sets);
+  free(re->inst);
+  free(re);
+}
+
+// Compiles pattern p[0..len), ignoring the case of ASCII letters if icase.
+// Returns NULL and sets *err if the pattern is malformed or too large.
+struct regex *regexCompile(const char *p, int len, int icase, const char **err) {
+  struct regex *re = calloc(1, sizeof(struct regex));
+  re->icase = icase;
+  const char *end = p + len;
+  if (p < end && *p == '^') {
+    re->bol = 1;
+    p++;
+  }
+  if (end > p && end[-1] == '$') {
+    int escapes = 0;
+    while (end - 1 - escapes > p && end[-2 - escapes] == '\\') escapes++;
+    if (escapes % 2 == 0) {
+      re->eol = 1;
+      end--;
+    }
+  }
+  int root = reParseAlt(re, &p, end);
+  if (root != -1 && p < end) re->err = "unmatched )";
+  if (root != -1 && (re->bol || re->eol) && re->barealt)
+    re->err = "put a|b in ( ) to anchor it";
+  if (root != -1 && !re->err) {
+    reClasses(re);
+    char run[sizeof(re->lit)];
+    int runlen = 0;
+    reLiteral(re, root, run, &runlen);
+    int match = reInstNew(re, RI_MATCH, -1, -1, -1);
+    re->start[0] = reEmit(re, root, match, 0);
+    re->start[1] = reEmit(re, root, match, 1);
+    if (re->ninst > REGEX_MAX_INST) re->err = "pattern too large";
   }
+  if (re->err) {
+    *err = re->err;
+    regexFree(re);
+    return NULL;
+  }
+  return re;
 }
 
+#define RE_ACCEPT 1       // The state has read a match
+#define RE_DEAD 2         // No match can follow from the state
 
-/*** row operations ***/
-
-// Converts a cursor x-position into a rendered x-position (accounts for tabs)
-int editorRowCxToRx(erow *row, int cx) {
-  int rx = 0;
-  for (int j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t')
-      rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-    rx++;
-  }
-  return rx;
+void reDfaFlush(struct reDfa *d) {
+  d->nstates = 0;
+  d->listused = 0;
+  memset(d->hash, 0, sizeof(d->hash));
+  d->flushes++;
+  d->start = -1;
 }
 
+void reDfaInit(struct reDfa *d, const struct regex *re, int dir, int floating) {
+  memset(d, 0, sizeof(*d));
+  d->re = re;
+  d->dir = dir;
+  d->floating = floating;
+  d->start = -1;
+  d->mark = calloc(re->ninst, sizeof(int));
+  d->work = malloc(sizeof(int) * re->ninst);
+}
 
-
-int editorRowRxToCx(erow *row, int rx) {
-  int cur_rx = 0;
-  int cx;
-  for (cx = 0; cx < row->size; cx++) {
-    if (row->chars[cx] == '\t')
-      cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
-    cur_rx++;
-    if (cur_rx > rx) return cx;
-  }
-  return cx;
+void reDfaFree(struct reDfa *d) {
+  free(d->listoff);
+  free(d->listlen);
+  free(d->list);
+  free(d->next);
+  free(d->flags);
+  free(d->mark);
+  free(d->work);
 }
 
+// The DFAs regexFind needs for a pattern, one per direction
+void regexDfaInit(struct reDfa dfa[2], const struct regex *re) {
+  reDfaInit(&dfa[0], re, 0, 0);
+  reDfaInit(&dfa[1], re, 1, !re->eol);
+}
 
-// Updates the rendered version of a row (expands tabs into spaces)
+void regexDfaFree(struct reDfa dfa[2]) {
+  reDfaFree(&dfa[0]);
+  reDfaFree(&dfa[1]);
+}
 
-void editorUpdateRow(erow *row) {
-  int tabs = 0;
-  int j;
-  for (j = 0; j < row->size; j++)
-    if (row->chars[j] == '\t') tabs++;
-  free(row->render);
-  row->render = malloc(row->size + tabs*(KILO_TAB_STOP - 1) + 1);
-  int idx = 0;
-  for (j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
-    } else {
-      row->render[idx++] = row->chars[j];
+// Adds instruction i and everything reachable from it without reading a byte
+// to d->work (n entries so far), keeping only RI_SET and RI_MATCH
+int reClosure(struct reDfa *d, int i, int n) {
+  const struct reInst *inst = d->re->inst;
+  while (i != -1 && d->mark[i] != d->gen) {
+    d->mark[i] = d->gen;
+    if (inst[i].op != RI_SPLIT) {
+      d->work[n++] = i;
+      return n;
     }
+    n = reClosure(d, inst[i].out1, n);
+    i = inst[i].out;
   }
-  row->render[idx] = '\0';
-  row->rsize = idx;
-  editorUpdateSyntax(row);
+  return n;
 }
 
-// Appends a new row of text to the editor buffer at position `at`
-// this shifts existing rows down and inserts the new row. used for open and newline.
-void editorInsertRow(int at, char *s, size_t len) {
-  if (at < 0 || at > E.numrows) return;
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-  for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
-
-  E.row[at].idx = at;
-
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  E.row[at].hl = NULL;
-  E.row[at].hl_open_comment = 0;
-  editorUpdateRow(&E.row[at]);
-  E.numrows++;
-  E.dirty++;
+int reIntCmp(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
 }
 
-// Frees memory used by a row
-void editorFreeRow(erow *row) {
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
+// The state for the n instructions in d->work, added if it's new
+int reDfaState(struct reDfa *d, int n) {
+  qsort(d->work, n, sizeof(int), reIntCmp);
+  unsigned int h = 2166136261u;
+  for (int k = 0; k < n; k++) h = (h ^ d->work[k]) * 16777619u;
+  unsigned int mask = REGEX_DFA_STATES * 2 - 1;
+  for (unsigned int slot = h & mask;; slot = (slot + 1) & mask) {
+    int s = d->hash[slot] - 1;
+    if (s == -1) break;
+    if (d->listlen[s] == n && !memcmp(&d->list[d->listoff[s]], d->work, sizeof(int) * n)) return s;
+  }
+  if (d->nstates == REGEX_DFA_STATES) reDfaFlush(d);
+  if (d->nstates == d->cap) {
+    d->cap = d->cap ? d->cap * 2 : 16;
+    d->listoff = realloc(d->listoff, sizeof(int) * d->cap);
+    d->listlen = realloc(d->listlen, sizeof(int) * d->cap);
+    d->flags = realloc(d->flags, d->cap * d->re->nclass);
+    d->next = realloc(d->next, sizeof(int) * d->cap * d->re->nclass);
+  }
+  if (d->listused + n > d->listcap) {
+    d->listcap = (d->listused + n) * 2;
+    d->list = realloc(d->list, sizeof(int) * d->listcap);
+  }
+  int s = d->nstates++;
+  d->listoff[s] = d->listused;
+  d->listlen[s] = n;
+  memcpy(&d->list[d->listused], d->work, sizeof(int) * n);
+  d->listused += n;
+  unsigned char *flags = &d->flags[s * d->re->nclass];
+  *flags = (n == 0) ? RE_DEAD : 0;
+  for (int k = 0; k < n; k++)
+    if (d->re->inst[d->work[k]].op == RI_MATCH) *flags = RE_ACCEPT;
+  for (int k = 0; k < d->re->nclass; k++) d->next[s * d->re->nclass + k] = -1;
+  unsigned int slot = h & mask;
+  while (d->hash[slot]) slot = (slot + 1) & mask;
+  d->hash[slot] = s + 1;
+  return s;
 }
 
-// Delete the row at position `at` and shift remaining rows up.
-void editorDelRow(int at) {
-  if (at < 0 || at >= E.numrows) return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-  for (int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
-  E.numrows--;
-  E.dirty++;
+int reDfaStart(struct reDfa *d) {
+  if (d->start == -1) {
+    d->gen++;
+    int s = reDfaState(d, reClosure(d, d->re->start[d->dir], 0));
+    d->start = s;  // after reDfaState, which may have flushed
+  }
+  return d->start;
 }
 
-// Insert character c at position at inside a given row. resize and update render.
-void editorRowInsertChar(erow *row, int at, int c) {
-  if (at < 0 || at > row->size) at = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1); // include null
-  row->size++;
-  row->chars[at] = c;
-  editorUpdateRow(row);
-  E.dirty++;
+// Works out the move from state s on byte c, the first time it's needed
+int reDfaMove(struct reDfa *d, int s, unsigned char c) {
+  const struct regex *re = d->re;
+  int cls = re->cls[c];
+  d->gen++;
+  int n = 0;
+  for (int k = 0; k < d->listlen[s]; k++) {
+    const struct reInst *in = &re->inst[d->list[d->listoff[s] + k]];
+    if (in->op == RI_SET && reSetHas(re, in->set, re->clsbyte[cls])) n = reClosure(d, in->out, n);
+  }
+  if (d->floating) n = reClosure(d, re->start[d->dir], n);
+  int flushes = d->flushes;
+  int t = reDfaState(d, n);
+  if (d->flushes == flushes) d->next[s * re->nclass + cls] = t * re->nclass;
+  return t;
 }
 
-// Delete character at `at` inside row
-void editorRowDelChar(erow *row, int at) {
-  if (at < 0 || at >= row->size) return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  editorUpdateRow(row);
-  E.dirty++;
+// The row of the state after reading byte c in the state at row b. Rows
+// rather than state numbers keep a multiply off the path from byte to byte.
+static inline int reDfaStep(struct reDfa *d, const unsigned char *cls, int nclass, int b, unsigned char c) {
+  int t = d->next[b + cls[c]];
+  return (t != -1) ? t : reDfaMove(d, b / nclass, c) * nclass;
 }
 
-// Append a c-string of length len to the end of a row
-void editorRowAppendString(erow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
-  E.dirty++;
+// Finds the leftmost-longest match in s[0..len): a backward pass marks where
+// matches start, the leftmost is taken, and a forward pass from there finds
+// where the longest match ends. Returns its start and sets *end, or -1.
+int regexFind(struct reDfa dfa[2], const char *s, int len, int *end) {
+  const struct regex *re = dfa[0].re;
+  int start = -1;
+  if (re->bol) {
+    start = 0;
+  } else {
+    struct reDfa *d = &dfa[1];
+    int b = reDfaStart(d) * re->nclass;
+    if (d->flags[b] & RE_ACCEPT) start = len;
+    for (int i = len - 1; i >= 0 && !(d->flags[b] & RE_DEAD); i--) {
+      b = reDfaStep(d, re->cls, re->nclass, b, s[i]);
+      if (d->flags[b] & RE_ACCEPT) start = i;
+    }
+    if (start == -1) return -1;
+  }
+  struct reDfa *d = &dfa[0];
+  int b = reDfaStart(d) * re->nclass;
+  int e = (d->flags[b] & RE_ACCEPT) ? start : -1;
+  for (int i = start; i < len && !(d->flags[b] & RE_DEAD); i++) {
+    b = reDfaStep(d, re->cls, re->nclass, b, s[i]);
+    if (d->flags[b] & RE_ACCEPT) e = i + 1;
+  }
+  if (e == -1 || (re->eol && e != len)) return -1;
+  *end = e;
+  return start;
 }
 
-/*** editor operations ***/
+/*** find ***/
 
-// Insert a character at the current cursor position, creating a row if needed
-void editorInsertChar(int c) {
-  if (E.cy == E.numrows) {
-    // we're at a new line after the last row; insert an empty row
-    editorInsertRow(E.numrows, "", 0);
+// Rows matching one query prefix, with the byte offset of each row's first match
+struct findLevel {
+  int qlen;               // Length of the query prefix these rows match
+  int *rows;
+  int *cols;
+  int n;
+  int cap;
+};
+
+// Incremental search keeps a stack of levels, one per query length searched
+// for. A longer query only rechecks the rows of the level below it, since
+// every match of it is a match of its prefix; backspacing pops back to a
+// level that's already known. Patterns don't narrow like that (a longer
+// pattern may match more), so in regex mode every new query searches it all.
+struct findState {
+  int active;             // 1 while the search prompt is up
+  int icase;              // 1 to ignore the case of ASCII letters (Ctrl-T toggles)
+  int regex;              // 1 if the query is a pattern (Ctrl-R toggles)
+  char *query;            // The query the top level was found for
+  struct regex *re;       // The query compiled, in regex mode
+  const char *reerr;      // Why the query didn't compile, NULL if it did
+  struct findLevel *levels;
+  int nlevels;
+  int cap;
+  int current;            // Selected entry of the top level, -1 if none
+  int origin;             // Row the cursor was on when the search started
+};
+
+struct findState find;
+
+// A search pass split into chunks of rows (or of prev's rows) for the pool
+struct findScan {
+  struct findLevel *prev;   // Rows to recheck, NULL to search every row
+  struct regex *re;         // Pattern to match, NULL to search for the query itself
+  struct needle nd;         // The query, or the pattern's literal (len 0 if it has none)
+  int total;                // Rows to search
+  int first;                // Chunk searched first, the one at the search's origin
+  int done;                 // Chunks searched so far, counting on from first
+  int nchunks;
+  struct findLevel *out;    // Matches found by each chunk
+  int cancel;               // Set once a newer query is waiting
+};
+
+// Byte offset of the first match at or after byte `from` of s[0..len), or -1.
+// A pattern is only run on rows holding its literal; patterns are always
+// searched for from the start of a row (their levels aren't narrowed).
+int findMatch(struct findScan *fs, struct reDfa *dfa, const char *s, int len, int from) {
+  if (from > len) return -1;
+  if (fs->re == NULL) {
+    int at = editorFindBytes(&fs->nd, &s[from], len - from);
+    return (at == -1) ? -1 : from + at;
   }
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
-  E.cx++;
+  if (fs->nd.len && editorFindBytes(&fs->nd, s, len) == -1) return -1;
+  int end;
+  return regexFind(dfa, s, len, &end);
 }
 
-// Insert a newline at the current cursor position: split current row or insert empty row
-void editorInsertNewline(void) {
-  if (E.cx == 0) {
-    // cursor at start — insert empty row at current position
-    editorInsertRow(E.cy, "", 0);
+// Byte offset of the first match at or after byte `from` in row j of leaf, or
+// -1. Matches are found in the raw text, never in render: rows that aren't
+// loaded are searched in the mapping without loading them.
+int editorFindInRow(rowNode *leaf, int j, struct findScan *fs, struct reDfa *dfa, int from) {
+  const char *s;
+  int len;
+  if (leaf->lazy != -1) {
+    off_t start = E.lineoff[leaf->lazy + j];
+    off_t end = E.lineoff[leaf->lazy + j + 1] - 1;
+    while (end > start && E.map[end - 1] == '\r') end--;
+    s = &E.map[start];
+    len = end - start;
   } else {
-    // split current row at cursor
-    erow *row = &E.row[E.cy];
-    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    row = &E.row[E.cy];
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+    erow *row = &leaf->rows[j];
+    s = row->chars ? row->chars : &E.map[row->foff];  // no gap: see editorFindLevel
+    len = row->size;
   }
-  E.cy++;
-  E.cx = 0;
+  return findMatch(fs, dfa, s, len, from);
 }
 
-// Delete a character at the cursor (backspace behavior)
-// if at start of line, append this row into previous and delete the row.
-void editorDelChar(void) {
-  if (E.cy == E.numrows) return;
-  if (E.cx == 0 && E.cy == 0) return;
-
-  erow *row = &E.row[E.cy];
-  if (E.cx > 0) {
-    editorRowDelChar(row, E.cx - 1);
-    E.cx--;
-  } else {
-    // join this line with previous
-    int prev_len = E.row[E.cy - 1].size;
-    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-    editorDelRow(E.cy);
-    E.cy--;
-    E.cx = prev_len;
+// Adds row `at` with its first match at byte col to level lv
+void findLevelAdd(struct findLevel *lv, int at, int col) {
+  if (lv->n == lv->cap) {
+    lv->cap = lv->cap ? lv->cap * 2 : 64;
+    lv->rows = realloc(lv->rows, sizeof(int) * lv->cap);
+    lv->cols = realloc(lv->cols, sizeof(int) * lv->cap);
   }
+  lv->rows[lv->n] = at;
+  lv->cols[lv->n] = col;
+  lv->n++;
 }
 
-/*** file I/O ***/
-
-// Converts all rows to a single buffer with '\n' separators, returns pointer and sets buflen
-char *editorRowsToString(int *buflen) {
-  int totlen = 0;
-  for (int j = 0; j < E.numrows; j++)
-    totlen += E.row[j].size + 1; // include '\n'
-
-  *buflen = totlen;
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (int j = 0; j < E.numrows; j++) {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n';
-    p++;
+// While the prompt is up, a search gives way as soon as another key is typed:
+// its result would only be thrown away
+int editorFindCancelled(struct findScan *fs) {
+  if (__atomic_load_n(&fs->cancel, __ATOMIC_RELAXED)) return 1;
+  if (!find.active) return 0;
+  struct pollfd in = {STDIN_FILENO, POLLIN, 0};
+  if (editorInputPending() || (!replay && poll(&in, 1, 0) > 0)) {
+    __atomic_store_n(&fs->cancel, 1, __ATOMIC_RELAXED);
+    return 1;
   }
-  return buf;
+  return 0;
 }
 
-// Opens a file and reads its contents line by line
-void editorOpen(char *filename) {
-  free(E.filename);
-  E.filename = strdup(filename);
-
-
-  FILE *fp = fopen(filename, "r");
-  if (!fp) die("fopen");
-
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
+// Searches rows [from, to) of a lazy leaf, lines [from + shift, to + shift) of
+// the mapping, as one span: the query holds no newline, so no match runs from
+// one line into the next, and the finder gets long runs to work on. A pattern
+// without a literal is run row by row.
+void findScanSpan(struct findScan *fs, struct reDfa *dfa, int k, int shift, int from, int to) {
+  off_t *line = &E.lineoff[shift];
+  off_t end = line[to] - 1;
+  off_t p = line[from];
+  off_t m = p;
+  int r = from;
+  while (r < to) {
+    if (fs->nd.len) {
+      int at = editorFindBytes(&fs->nd, &E.map[p], end - p);
+      if (at == -1) return;
+      m = p + at;
+      int hi = to - 1;  // the match is in the last row starting at or before it
+      while (r < hi) {
+        int mid = (r + hi + 1) / 2;
+        if (line[mid] <= m) r = mid;
+        else hi = mid - 1;
+      }
+    }
+    int col = m - line[r];
+    if (fs->re) {
+      off_t stop = line[r + 1] - 1;
+      while (stop > line[r] && E.map[stop - 1] == '\r') stop--;
+      col = findMatch(fs, dfa, &E.map[line[r]], stop - line[r], 0);
+    }
+    if (col != -1) findLevelAdd(&fs->out[k], r, col);
+    r++;
+    p = line[r];
+  }
+}
 
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                           line[linelen - 1] == '\r'))
-      linelen--;
-    editorInsertRow(E.numrows, line, linelen);
+void findScanChunk(void *arg, int k) {
+  struct findScan *fs = arg;
+  k = (fs->first + fs->done + k) % fs->nchunks;
+  int from = k * FIND_CHUNK_ROWS;
+  int to = (from + FIND_CHUNK_ROWS < fs->total) ? from + FIND_CHUNK_ROWS : fs->total;
+  struct reDfa dfa[2];  // each chunk has its own DFA cache, so threads don't share one
+  if (fs->re) regexDfaInit(dfa, fs->re);
+  rowNode *leaf = NULL;
+  int base = 0;
+  int check = from;
+  for (int i = from; i < to;) {
+    if (i >= check) {
+      if (editorFindCancelled(fs)) break;
+      check = i + FIND_CHECK_ROWS;
+    }
+    int at = fs->prev ? fs->prev->rows[i] : i;
+    if (leaf == NULL || at >= base + leaf->n) leaf = rowTreeSeek(at, &base);
+    if (fs->prev == NULL && leaf->lazy != -1) {
+      int end = (base + leaf->n < to) ? base + leaf->n : to;
+      findScanSpan(fs, dfa, k, leaf->lazy - base, i, end);
+      i = end;
+      continue;
+    }
+    int col = editorFindInRow(leaf, at - base, fs, dfa, fs->prev ? fs->prev->cols[i] : 0);
+    if (col != -1) findLevelAdd(&fs->out[k], at, col);
+    i++;
   }
+  if (fs->re) regexDfaFree(dfa);
+}
 
-  free(line);
-  fclose(fp);
-  E.dirty = 0;
-  editorSelectSyntaxHighlight();
+// Index of the first match at or after row `at` in lv, wrapping to the first
+int findLevelNearest(struct findLevel *lv, int at) {
+  int lo = 0, hi = lv->n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (lv->rows[mid] < at) lo = mid + 1;
+    else hi = mid;
+  }
+  return (lo < lv->n) ? lo : 0;
+}
 
+// Moves to a match and draws it, while the rest of the file is still to search
+void editorFindShow(int row, int col) {
+  E.cy = row;
+  E.cx = col;
+  E.rowoff = E.numrows;
+  editorScroll();
+  editorRefreshScreen();
 }
 
-// Save buffer to disk. If no filename, prompt user (editorPrompt)
-void editorSave() {
-  if (E.filename == NULL) {
-    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-    if (E.filename == NULL) {
-      editorSetStatusMessage("Save aborted");
-      return;
+// Finds the rows matching q (or the pattern re, if not NULL): every row if
+// prev is NULL, else only prev's rows, each from where its match for the
+// shorter query was. Chunks go to the pool, each thread taking the next one
+// as it finishes, and their matches are joined in row order. Returns -1 if
+// the search gave way to a newer query.
+//
+// While the prompt is up the chunks are taken from the cursor's on, a round
+// of one per thread at a time, until one holds a match: that is the nearest,
+// so it is shown at once and the rest of the file searched after.
+int editorFindLevel(struct findLevel *lv, struct findLevel *prev, const char *q, int qlen,
+                    int icase, struct regex *re) {
+  struct findScan fs;
+  fs.prev = prev;
+  fs.re = re;
+  fs.nd.len = 0;
+  if (re == NULL) needleInit(&fs.nd, q, qlen, icase);
+  else if (re->litlen) needleInit(&fs.nd, re->lit, re->litlen, re->icase);
+  fs.total = prev ? prev->n : E.numrows;
+  fs.cancel = 0;
+  editorFlattenGapRow();  // so every loaded row's chars are contiguous
+  fs.nchunks = (fs.total + FIND_CHUNK_ROWS - 1) / FIND_CHUNK_ROWS;
+  fs.out = calloc(fs.nchunks ? fs.nchunks : 1, sizeof(struct findLevel));
+  int start = 0;  // Where the nearest match is looked for from, as an index into the rows searched
+  if (find.active && fs.total) {
+    start = prev ? findLevelNearest(prev, find.origin) : find.origin;
+    if (start >= fs.total) start = 0;
+  }
+  int startrow = prev && fs.total ? prev->rows[start] : start;
+  fs.first = start / FIND_CHUNK_ROWS;
+  fs.done = 0;
+  int shown = !find.active;
+  while (fs.done < fs.nchunks && !fs.cancel) {
+    int n = fs.nchunks - fs.done;
+    if (!shown && n > E.nthreads) n = E.nthreads;
+    poolRun(findScanChunk, &fs, n);
+    fs.done += n;
+    if (shown || fs.cancel || fs.done == fs.nchunks) continue;
+    // the first match in the chunks so far, past the start, is the nearest
+    for (int i = 0; i < fs.done && !shown; i++) {
+      struct findLevel *out = &fs.out[(fs.first + i) % fs.nchunks];
+      for (int j = 0; j < out->n; j++) {
+        if (out->rows[j] < startrow) continue;  // comes last, after the wrap
+        editorFindShow(out->rows[j], out->cols[j]);
+        shown = 1;
+        break;
+      }
     }
-    editorSelectSyntaxHighlight();
   }
-  int len;
-  char *buf = editorRowsToString(&len);
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
+
+  lv->n = 0;
+  for (int k = 0; k < fs.nchunks; k++) {
+    if (!fs.cancel && fs.out[k].n) {
+      if (lv->n + fs.out[k].n > lv->cap) {
+        lv->cap = lv->n + fs.out[k].n;
+        lv->rows = realloc(lv->rows, sizeof(int) * lv->cap);
+        lv->cols = realloc(lv->cols, sizeof(int) * lv->cap);
       }
+      memcpy(&lv->rows[lv->n], fs.out[k].rows, sizeof(int) * fs.out[k].n);
+      memcpy(&lv->cols[lv->n], fs.out[k].cols, sizeof(int) * fs.out[k].n);
+      lv->n += fs.out[k].n;
+    }
+    free(fs.out[k].rows);
+    free(fs.out[k].cols);
+  }
+  free(fs.out);
+  return fs.cancel ? -1 : 0;
+}
+
+// Brings the level stack up to date with query, reusing the levels of the
+// longest prefix it shares with the last query
+void editorFindUpdate(char *query) {
+  int qlen = strlen(query);
+  int common = 0;
+  if (find.regex) {
+    if (find.query && !strcmp(query, find.query)) common = qlen;
+  } else if (find.query) {
+    while (common < qlen && query[common] && query[common] == find.query[common]) common++;
+  }
+  if (find.regex && (common < qlen || !find.re)) {
+    regexFree(find.re);
+    find.re = NULL;
+    find.reerr = NULL;
+    if (qlen) find.re = regexCompile(query, qlen, find.icase, &find.reerr);
+  }
+  while (find.nlevels > 0 && find.levels[find.nlevels - 1].qlen > common) {
+    find.nlevels--;
+    free(find.levels[find.nlevels].rows);
+    free(find.levels[find.nlevels].cols);
+  }
+  if (qlen > 0 && !find.reerr && (find.nlevels == 0 || find.levels[find.nlevels - 1].qlen < qlen)) {
+    if (find.nlevels == find.cap) {
+      find.cap = find.cap ? find.cap * 2 : 8;
+      find.levels = realloc(find.levels, sizeof(struct findLevel) * find.cap);
+    }
+    struct findLevel *lv = &find.levels[find.nlevels];
+    memset(lv, 0, sizeof(*lv));
+    lv->qlen = qlen;
+    if (editorFindLevel(lv, find.nlevels ? lv - 1 : NULL, query, qlen, find.icase, find.re) == 0) {
+      find.nlevels++;
+    } else {
+      free(lv->rows);
+      free(lv->cols);
     }
-    close(fd);
   }
-  free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+  free(find.query);
+  find.query = strdup(query);
 }
 
+// The level for the whole current query, NULL if its search gave way to a
+// newer one (or the query is empty)
+struct findLevel *editorFindTop(void) {
+  if (find.nlevels == 0) return NULL;
+  struct findLevel *lv = &find.levels[find.nlevels - 1];
+  return (lv->qlen == (int)strlen(find.query)) ? lv : NULL;
+}
 
-/*** find ***/
+// Forgets every level, when the search is over
+void editorFindReset(void) {
+  while (find.nlevels > 0) {
+    find.nlevels--;
+    free(find.levels[find.nlevels].rows);
+    free(find.levels[find.nlevels].cols);
+  }
+  free(find.query);
+  find.query = NULL;
+  regexFree(find.re);
+  find.re = NULL;
+  find.reerr = NULL;
+  find.current = -1;
+}
 
 void editorFindCallback(char *query, int key) {
-  static int last_match = -1;
-  static int direction = 1;
   static int saved_hl_line;
   static char *saved_hl = NULL;
   if (saved_hl) {
-    if (E.row[saved_hl_line].hl == NULL) editorUpdateSyntax(&E.row[saved_hl_line]);
-
-    memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
+    erow *row = editorRowAt(saved_hl_line);
+    if (row->tabs && row->tabs->win) row->hl_in = -1;  // the window may have moved since
+    else hlCompress(row, (unsigned char *)saved_hl);
     free(saved_hl);
     saved_hl = NULL;
   }
+  if (key == '\r' && query[0] == '\0') return;  // the prompt stays up
+  if (key == '\r' && editorFindTop() == NULL) {
+    // Enter came in while the query's search gave way; it finishes, uncancelled
+    find.active = 0;
+    editorFindUpdate(query);
+    struct findLevel *lv = editorFindTop();
+    if (lv && lv->n) {
+      int i = findLevelNearest(lv, find.origin);
+      E.cy = lv->rows[i];
+      E.cx = lv->cols[i];
+      E.rowoff = E.numrows;
+    }
+  }
   if (key == '\r' || key == '\x1b') {
-    last_match = -1;
-    direction = 1;
+    editorFindReset();
+    find.active = 0;
     return;
-  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-    direction = 1;
-  } else if (key == ARROW_LEFT || key == ARROW_UP) {
-    direction = -1;
+  }
+  if (key == CTRL_KEY('t')) {
+    find.icase = !find.icase;
+    editorFindReset();  // every level was found with the other setting
+  }
+  if (key == CTRL_KEY('r')) {
+    find.regex = !find.regex;
+    editorFindReset();
+  }
+  struct findLevel *lv = editorFindTop();
+  if (lv && (key == ARROW_RIGHT || key == ARROW_DOWN || key == ARROW_LEFT || key == ARROW_UP)) {
+    if (lv->n == 0) return;
+    int direction = (key == ARROW_RIGHT || key == ARROW_DOWN) ? 1 : -1;
+    find.current = (find.current + direction + lv->n) % lv->n;
   } else {
-    last_match = -1;
-    direction = 1;
-  }
-  if (last_match == -1) direction = 1;
-  int current = last_match;
-  int i;
-  for (i = 0; i < E.numrows; i++) {
-    current += direction;
-    if (current == -1) current = E.numrows - 1;
-    else if (current == E.numrows) current = 0;
-    erow *row = &E.row[current];
-    char *match = strstr(row->render, query);
-    if (match) {
-      last_match = current;
-      E.cy = current;
-      E.cx = editorRowRxToCx(row, match - row->render);
-      E.rowoff = E.numrows;
+    editorFindUpdate(query);
+    lv = editorFindTop();
+    find.current = (lv && lv->n) ? findLevelNearest(lv, find.origin) : -1;
+  }
+  if (find.current == -1) return;
 
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-      break;
-    }
+  int current = lv->rows[find.current];
+  erow *row = editorRowAt(current);
+  int col = lv->cols[find.current];
+  E.cy = current;
+  E.cx = col;
+  E.rowoff = E.numrows;
+
+  // hl must be current before the match is painted on, or drawing redoes it;
+  // a long row's window must be where the screen is about to scroll to
+  editorScroll();
+  editorRowHighlight(row, editorSyntaxStateAt(current));
+  saved_hl_line = current;
+  saved_hl = malloc(row->rsize + 1);
+  hlExpand(row, 0, row->rsize, (unsigned char *)saved_hl);
+  int end = col + strlen(query);
+  if (find.re) {
+    struct reDfa dfa[2];
+    regexDfaInit(dfa, find.re);
+    regexFind(dfa, editorRowData(row), row->size, &end);
+    regexDfaFree(dfa);
   }
+  int rx = editorRowCxToRx(row, col) - row->rxoff;
+  int rxend = editorRowCxToRx(row, end) - row->rxoff;
+  if (rx < 0) rx = 0;
+  if (rxend > row->rsize) rxend = row->rsize;
+  unsigned char *hl = hlScratch(row->rsize + 1);
+  memcpy(hl, saved_hl, row->rsize);
+  if (rxend > rx) memset(&hl[rx], HL_MATCH, rxend - rx);
+  hlCompress(row, hl);
 }
 
 void editorFind() {
@@ -717,7 +4258,10 @@ void editorFind() {
   int saved_cy = E.cy;
   int saved_coloff = E.coloff;
   int saved_rowoff = E.rowoff;
-  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)",
+  find.active = 1;
+  find.current = -1;
+  find.origin = E.cy;
+  char *query = editorPrompt("Search: %s (ESC/Arrows/Enter, Ctrl-T: case, Ctrl-R: regex)",
                              editorFindCallback);
   if (query) {
     free(query);
@@ -731,26 +4275,33 @@ void editorFind() {
 
 /*** append buffer ***/
 
-// Append buffer: accumulates screen output before writing it all at once
+// Append buffer: accumulates screen output before writing it all at once.
+// It's kept between frames, so once it has grown to a frame's size appending
+// is just a copy.
 struct abuf {
   char *b;
   int len;
+  int cap;
 };
 
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0}
 
-// Appends string s of length len to buffer ab
-void abAppend(struct abuf *ab, const char *s, int len) {
-  char *new = realloc(ab->b, ab->len + len);
-  if (new == NULL) return;
-  memcpy(&new[ab->len], s, len);
+// Grows buffer ab, doubling it, until len more bytes fit
+int abGrow(struct abuf *ab, int len) {
+  int cap = ab->cap ? ab->cap : 4096;
+  while (cap < ab->len + len) cap *= 2;
+  char *new = realloc(ab->b, cap);
+  if (new == NULL) return -1;
   ab->b = new;
-  ab->len += len;
+  ab->cap = cap;
+  return 0;
 }
 
-// Frees the memory used by the buffer
-void abFree(struct abuf *ab) {
-  free(ab->b);
+// Appends string s of length len to buffer ab
+static inline void abAppend(struct abuf *ab, const char *s, int len) {
+  if (ab->len + len > ab->cap && abGrow(ab, len) == -1) return;
+  memcpy(&ab->b[ab->len], s, len);
+  ab->len += len;
 }
 
 /*** output ***/
@@ -759,7 +4310,7 @@ void abFree(struct abuf *ab) {
 void editorScroll(void) {
   E.rx = 0;
   if (E.cy < E.numrows)
-    E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+    E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
 
   if (E.cy < E.rowoff)
     E.rowoff = E.cy;
@@ -772,12 +4323,74 @@ void editorScroll(void) {
     E.coloff = E.rx - E.screencols + 1;
 }
 
+// SGR escapes taking the terminal from one cell attribute to another, with
+// an extra first row for when the terminal's state isn't known
+struct sgr {
+  char s[15];
+  unsigned char len;
+} sgrTable[CELL_ATTRS + 1][CELL_ATTRS];
+
+// Control characters, which are drawn as symbols
+struct byteSet screenCtrl;
+
+// Fills sgrTable, so frames are written without formatting any escapes, and
+// screenCtrl
+void editorScreenInit(void) {
+  byteSetInit(&screenCtrl);
+  for (int c = 0; c < 256; c++)
+    if (iscntrl(c)) byteSetAdd(&screenCtrl, c);
+  for (int from = 0; from <= CELL_ATTRS; from++) {
+    for (int to = 0; to < CELL_ATTRS; to++) {
+      struct sgr *e = &sgrTable[from][to];
+      int inv = to & CELL_INVERSE;
+      int color = (to & ~CELL_INVERSE) == HL_NORMAL ? 39 : editorSyntaxToColor(to & ~CELL_INVERSE);
+      int was = (from & ~CELL_INVERSE) == HL_NORMAL ? 39 : editorSyntaxToColor(from & ~CELL_INVERSE);
+      int len;
+      if (from == CELL_ATTRS || ((from & CELL_INVERSE) && !inv)) {
+        // inverse can only be dropped by starting over from the defaults
+        len = snprintf(e->s, sizeof(e->s), "\x1b[0%s", inv ? ";7" : "");
+        if (color != 39) len += snprintf(&e->s[len], sizeof(e->s) - len, ";%d", color);
+        e->s[len++] = 'm';
+      } else if (color == was && inv == (from & CELL_INVERSE)) {
+        len = 0;
+      } else {
+        len = snprintf(e->s, sizeof(e->s), "\x1b[");
+        if (inv && !(from & CELL_INVERSE))
+          len += snprintf(&e->s[len], sizeof(e->s) - len, "7;");
+        if (color != was)
+          len += snprintf(&e->s[len], sizeof(e->s) - len, "%d;", color);
+        e->s[len - 1] = 'm';  // over the last ';'
+      }
+      e->len = len;
+    }
+  }
+}
+
+// Writes len bytes of text into frame line y from column x on, in attr
+int frameText(int y, int x, const char *s, int len, unsigned char attr) {
+  if (len > E.screencols - x) len = E.screencols - x;
+  if (len <= 0) return x;
+  int at = y * E.screencols + x;
+  memcpy(&E.frame.c[at], s, len);
+  memset(&E.frame.attr[at], attr, len);
+  return x + len;
+}
+
+// Blanks frame line y from column x to its end
+void frameClear(int y, int x) {
+  int at = y * E.screencols + x;
+  memset(&E.frame.c[at], ' ', E.screencols - x);
+  memset(&E.frame.attr[at], HL_NORMAL, E.screencols - x);
+}
+
 // Draws the visible rows (or ~ for empty lines)
 
-void editorDrawRows(struct abuf *ab) {
+void editorDrawRows(void) {
+  int in_comment = -1;
   int y;
   for (y = 0; y < E.screenrows; y++) {
     int filerow = y + E.rowoff;
+    int x = 0;
     if (filerow >= E.numrows) {
       if (E.numrows == 0 && y == E.screenrows / 3) {
         char welcome[80];
@@ -786,108 +4399,242 @@ void editorDrawRows(struct abuf *ab) {
         if (welcomelen > E.screencols) welcomelen = E.screencols;
         int padding = (E.screencols - welcomelen) / 2;
         if (padding) {
-          abAppend(ab, "~", 1);
+          x = frameText(y, x, "~", 1, HL_NORMAL);
           padding--;
         }
-        while (padding--) abAppend(ab, " ", 1);
-        abAppend(ab, welcome, welcomelen);
+        while (padding--) x = frameText(y, x, " ", 1, HL_NORMAL);
+        x = frameText(y, x, welcome, welcomelen, HL_NORMAL);
       } else {
-        abAppend(ab, "~", 1);
+        x = frameText(y, x, "~", 1, HL_NORMAL);
       }
     } else {
-      int len = E.row[filerow].rsize - E.coloff;
+      erow *row = editorRowAt(filerow);
+      if (in_comment == -1) in_comment = editorSyntaxStateAt(filerow);
+      in_comment = editorRowHighlight(row, in_comment);
+      int from = E.coloff - row->rxoff;  // render may start past column 0 of a long row
+      int len = row->rsize - from;
       if (len < 0) len = 0;
       if (len > E.screencols) len = E.screencols;
-      char *c = &E.row[filerow].render[E.coloff];
-      unsigned char *hl = &E.row[filerow].hl[E.coloff];
-      int current_color = -1;
-      int j;
-      for (j = 0; j < len; j++) {
+      char *c = &row->render[from];
+      // cell attributes are highlight classes, so hl's runs go straight in
+      int at = y * E.screencols;
+      unsigned char *hl = &E.frame.attr[at];
+      memcpy(&E.frame.c[at], c, len);
+      hlExpand(row, from, len, hl);
+      int j = editorScan(c, len, &screenCtrl);
+      unsigned char current = j ? hl[j - 1] : HL_NORMAL;
+      for (; j < len; j++) {
         if (iscntrl(c[j])) {
-          char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          abAppend(ab, "\x1b[7m", 4);
-          abAppend(ab, &sym, 1);
-          abAppend(ab, "\x1b[m", 3);
-          if (current_color != -1) {
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-            abAppend(ab, buf, clen);
-          }
-        } else if (hl[j] == HL_NORMAL) {
-          if (current_color != -1) {
-            abAppend(ab, "\x1b[39m", 5);
-            current_color = -1;
-          }
-          abAppend(ab, &c[j], 1);
+          // shown inverted, in whatever colour came before it
+          E.frame.c[at + j] = (c[j] <= 26) ? '@' + c[j] : '?';
+          E.frame.attr[at + j] = CELL_INVERSE | current;
         } else {
-          int color = editorSyntaxToColor(hl[j]);
-          if (color != current_color) {
-            current_color = color;
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-            abAppend(ab, buf, clen);
-          }
-          abAppend(ab, &c[j], 1);
+          current = hl[j];
         }
       }
-      abAppend(ab, "\x1b[39m", 5);
+      x = len;
     }
-    abAppend(ab, "\x1b[K", 3);
-    abAppend(ab, "\r\n", 2);
+    frameClear(y, x);
   }
 }
 // Draws the status bar at the bottom of the screen
-void editorDrawStatusBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[7m", 4);
-  char status[80], rstatus[80];
+void editorDrawStatusBar(void) {
+  int y = E.screenrows;
+  char status[80], rstatus[200];
   int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
     E.filename ? E.filename : "[No Name]", E.numrows,
     E.dirty ? "(modified)" : "");
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
+  char counter[80] = "";
+  struct findLevel *lv = find.active ? editorFindTop() : NULL;
+  const char *mode = find.regex ? (find.icase ? "regex, ignoring case, " : "regex, ")
+                                : (find.icase ? "ignoring case, " : "");
+  if (find.active && find.reerr) {
+    snprintf(counter, sizeof(counter), "bad pattern (%s) | ", find.reerr);
+  } else if (lv) {
+    int n = lv->n;
+    if (n) snprintf(counter, sizeof(counter), "%smatch %d of %d | ", mode, find.current + 1, n);
+    else snprintf(counter, sizeof(counter), "%sno matches | ", mode);
+  }
+  char timings[80] = "";
+  if (prof.overlay)  // the frame before this one, and the key that led to this one
+    snprintf(timings, sizeof(timings), "frame %.2fms %ldB hl %d, key %.2fms | ",
+      prof.frame / 1e6, E.framebytes, prof.rehl, prof.key / 1e6);
+  int rlen = snprintf(rstatus, sizeof(rstatus), "%s%s%s | %d/%d", timings, counter,
     E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
+  if (len > E.screencols - rlen && rlen <= E.screencols) len = E.screencols - rlen;  // the right side wins
   if (len > E.screencols) len = E.screencols;
-  abAppend(ab, status, len);
+  frameText(y, 0, status, len, CELL_INVERSE);
   while (len < E.screencols) {
     if (E.screencols - len == rlen) {
-      abAppend(ab, rstatus, rlen);
+      frameText(y, len, rstatus, rlen, CELL_INVERSE);
       break;
     } else {
-      abAppend(ab, " ", 1);
+      frameText(y, len, " ", 1, CELL_INVERSE);
       len++;
     }
   }
-  abAppend(ab, "\x1b[m", 3);
-  abAppend(ab, "\r\n", 2);
 }
 
 // Draws the message bar (used for temporary messages)
-void editorDrawMessageBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[K", 3);
+void editorDrawMessageBar(void) {
+  int y = E.screenrows + 1;
   int msglen = strlen(E.statusmsg);
   if (msglen > E.screencols) msglen = E.screencols;
-  if (msglen && time(NULL) - E.statusmsg_time < 5)
-    abAppend(ab, E.statusmsg, msglen);
+  int x = 0;
+  if (save.active) {
+    char progress[32];
+    int len = snprintf(progress, sizeof(progress), "Saving... %d%% ", editorSavePercent());
+    x = frameText(y, 0, progress, len, HL_NORMAL);
+  }
+  if (msglen && time(NULL) - E.statusmsg_time < 5) {
+    x = frameText(y, x, E.statusmsg, msglen, HL_NORMAL);
+  } else if (E.stats) {
+    char stats[120];
+    int len = rowArenaStats(stats, sizeof(stats));
+    x = frameText(y, x, stats, len < (int)sizeof(stats) ? len : (int)sizeof(stats) - 1, HL_NORMAL);
+  }
+  frameClear(y, x);
+}
+
+// Switches the terminal from attribute *cur (CELL_ATTRS if unknown) to attr
+static inline void screenSetAttr(struct abuf *ab, int *cur, unsigned char attr) {
+  if (*cur == attr) return;
+  struct sgr *e = &sgrTable[*cur][attr];
+  abAppend(ab, e->s, e->len);
+  *cur = attr;
+}
+
+// Moves the terminal cursor from (*cy, *cx) to (y, x) as cheaply as it can.
+// A coordinate of -1 means the position isn't known.
+void screenMoveTo(struct abuf *ab, int *cy, int *cx, int y, int x) {
+  if (*cy == y && *cx == x) return;
+  char buf[32];
+  int len;
+  if (*cy == y && *cx != -1 && x > *cx)
+    len = snprintf(buf, sizeof(buf), "\x1b[%dC", x - *cx);
+  else if (x == 0 && *cy != -1 && y == *cy + 1)
+    len = snprintf(buf, sizeof(buf), "\r\n");
+  else
+    len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+  abAppend(ab, buf, len);
+  *cy = y;
+  *cx = x;
+}
+
+// Writes frame cells [from, to) of line y, one copy per run of same attribute
+void screenPutCells(struct abuf *ab, int *attr, int *cy, int *cx, int y, int from, int to) {
+  char *c = &E.frame.c[y * E.screencols];
+  unsigned char *a = &E.frame.attr[y * E.screencols];
+  screenMoveTo(ab, cy, cx, y, from);
+  int x = from;
+  while (x < to) {
+    int k = x + 1;
+    while (k < to && a[k] == a[x]) k++;
+    screenSetAttr(ab, attr, a[x]);
+    abAppend(ab, &c[x], k - x);
+    x = k;
+  }
+  // after the last column the cursor waits to wrap, so its column is unclear
+  *cx = (to < E.screencols) ? to : -1;
+}
+
+// Emits whatever differs between the new frame and what the terminal shows:
+// changed spans of each line, joined when the gap between them is shorter
+// than a cursor move, and an erase for a tail that became blank. Lines with
+// bytes above 0x7f are redrawn whole, as their columns can't be trusted.
+void editorFlushFrame(struct abuf *ab) {
+  int w = E.screencols;
+  int attr = CELL_ATTRS;
+  int cy = -1, cx = -1;
+  for (int y = 0; y < E.screenrows + 2; y++) {
+    char *now = &E.frame.c[y * w], *was = &E.screen.c[y * w];
+    unsigned char *nowa = &E.frame.attr[y * w], *wasa = &E.screen.attr[y * w];
+    int whole = !E.screenvalid;
+    if (!whole && !memcmp(now, was, w) && !memcmp(nowa, wasa, w)) continue;
+    for (int x = 0; x < w && !whole; x++)
+      if ((now[x] | was[x]) & 0x80) whole = 1;
+
+    int tail = w;  // the new line is blank from here on
+    while (tail > 0 && now[tail - 1] == ' ' && nowa[tail - 1] == HL_NORMAL) tail--;
+    int x = 0;
+    while (x < w) {
+      if (!whole) {
+        while (x < w && now[x] == was[x] && nowa[x] == wasa[x]) x++;
+        if (x == w) break;
+      }
+      int end = w;
+      if (!whole) {
+        int last = end = x + 1;
+        while (end < w && end - last < 4) {
+          if (now[end] != was[end] || nowa[end] != wasa[end]) last = end + 1;
+          end++;
+        }
+        end = last;
+      }
+      if (end > tail) {
+        if (x < tail) screenPutCells(ab, &attr, &cy, &cx, y, x, tail);
+        screenMoveTo(ab, &cy, &cx, y, tail < x ? x : tail);
+        screenSetAttr(ab, &attr, HL_NORMAL);
+        abAppend(ab, "\x1b[K", 3);
+        break;
+      }
+      screenPutCells(ab, &attr, &cy, &cx, y, x, end);
+      x = end;
+    }
+  }
+  screenSetAttr(ab, &attr, HL_NORMAL);
+  struct frame t = E.screen;
+  E.screen = E.frame;
+  E.frame = t;
+  E.screenvalid = 1;
 }
 
-// Refreshes the screen: redraws everything and repositions the cursor
+// Refreshes the screen: draws the new frame and sends only what changed
 void editorRefreshScreen(void) {
+  static struct abuf ab = ABUF_INIT;  // reused from frame to frame
+  long t = profBegin();
+
   editorScroll();
-  struct abuf ab = ABUF_INIT;
+  int cells = E.screencols * (E.screenrows + 2);
+  if (E.framecells != cells) {
+    free(E.frame.c);
+    free(E.screen.c);
+    E.frame.c = malloc(cells * 2);
+    E.frame.attr = (unsigned char *)&E.frame.c[cells];
+    E.screen.c = malloc(cells * 2);
+    E.screen.attr = (unsigned char *)&E.screen.c[cells];
+    E.framecells = cells;
+    E.screenvalid = 0;
+  }
+  long td = profBegin();
+  editorDrawRows();
+  profEnd(td, "editorDrawRows", "rows", E.screenrows);
+  editorDrawStatusBar();
+  editorDrawMessageBar();
 
+  ab.len = 0;
   abAppend(&ab, "\x1b[?25l", 6); // Hide cursor
-  abAppend(&ab, "\x1b[H", 3);    // Move cursor to top-left
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
+  int hidden = ab.len;
+  editorFlushFrame(&ab);
+  if (ab.len == hidden) ab.len = 0;  // nothing changed, so no need to hide it
 
   char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
+  int buflen = snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
     (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
-  abAppend(&ab, buf, strlen(buf));
-
-  abAppend(&ab, "\x1b[?25h", 6); // Show cursor again
-  write(STDOUT_FILENO, ab.b, ab.len);
-  abFree(&ab);
+  abAppend(&ab, buf, buflen);
+
+  if (ab.len > buflen) abAppend(&ab, "\x1b[?25h", 6); // Show cursor again
+  long tw = profBegin();
+  if (replay) replay->frame(ab.b, ab.len);
+  else write(STDOUT_FILENO, ab.b, ab.len);
+  profEnd(tw, "write", "bytes", ab.len);
+  E.framebytes = ab.len;
+  E.outbytes += ab.len;
+  E.frames++;
+  E.redraw = 0;
+  E.lastframe = editorNowMs();
+  if (t) prof.frame = profEnd(t, "editorRefreshScreen", "rehighlighted", prof.rehl);
+  prof.rehl = 0;
 }
 
 // Sets a status message to display for 5 seconds
@@ -899,6 +4646,101 @@ void editorSetStatusMessage(const char *fmt, ...) {
   E.statusmsg_time = time(NULL);
 }
 
+/*** event loop ***/
+
+int winchPipe[2] = {-1, -1};  // Written to on SIGWINCH, so poll() wakes up for it
+
+// Signal handler for terminal resizes: just wakes the event loop
+void editorHandleWinch(int sig) {
+  (void)sig;
+  int saved = errno;
+  if (write(winchPipe[1], "w", 1) == -1) {}  // a full pipe already has a wake-up
+  errno = saved;
+}
+
+// Sets up the pipe and handler that turn resizes into events
+void editorEventInit(void) {
+  if (pipe(winchPipe) == -1) die("pipe");
+  fcntl(winchPipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(winchPipe[1], F_SETFL, O_NONBLOCK);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = editorHandleWinch;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  if (sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
+}
+
+// Picks up the terminal's new size; the next frame is drawn from scratch
+void editorResize(void) {
+  int rows, cols;
+  if (getWindowSize(&rows, &cols) == -1) return;
+  E.screenrows = rows - 2;
+  E.screencols = cols;
+  E.screenvalid = 0;
+  E.redraw = 1;
+}
+
+// Returns a monotonic time in milliseconds, which a change of the wall clock
+// doesn't move
+long editorNowMs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// Sleeps until input arrives, drawing the frame that's owed first. A frame due
+// sooner than KILO_FRAME_MS after the last one waits out the interval, and keys
+// coming in meanwhile are handled first, so a burst of input gets one frame.
+// Without input the only wake-ups are resizes, the status message expiring and
+// a background save, which redraws its progress now and then and is finished
+// here when its writer is done.
+void editorWaitKey(void) {
+  while (!editorInputPending()) {
+    if (replay) {
+      // nothing to wait for: each key gets its frame, then the next is read
+      // and a save is finished first, so a replay does the same work each run
+      if (E.redraw) editorRefreshScreen();
+      editorSaveWait();
+      editorFillInput(-1);
+      continue;
+    }
+    long now = editorNowMs();
+    int timeout = -1;
+    if (E.redraw) {
+      timeout = E.lastframe + KILO_FRAME_MS - now;
+      if (timeout <= 0) {
+        editorRefreshScreen();
+        continue;
+      }
+    } else if (E.statusmsg[0]) {
+      struct timespec wall;  // statusmsg_time is wall-clock time
+      clock_gettime(CLOCK_REALTIME, &wall);
+      long left = (E.statusmsg_time + 5) * 1000L - (wall.tv_sec * 1000L + wall.tv_nsec / 1000000);
+      if (left > 0) timeout = left;
+    }
+    if (save.active && (timeout == -1 || timeout > KILO_SAVE_TICK)) timeout = KILO_SAVE_TICK;
+
+    struct pollfd fds[3] = {{STDIN_FILENO, POLLIN, 0}, {winchPipe[0], POLLIN, 0},
+                            {save.active ? save.done[0] : -1, POLLIN, 0}};
+    int n = poll(fds, 3, timeout);
+    if (n == -1) continue;  // interrupted by the resize signal itself
+    if (n == 0) {
+      E.redraw = 1;  // a paced frame, the message expiring or save progress
+      continue;
+    }
+    if (fds[1].revents & POLLIN) {
+      char buf[64];
+      while (read(winchPipe[0], buf, sizeof(buf)) > 0);
+      editorResize();
+    }
+    if (fds[2].revents & POLLIN) editorSaveFinish();
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      if (editorFillInput(0) == 0 && (fds[0].revents & POLLHUP)) die("read");
+    }
+  }
+}
+
 /*** input ***/
 char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
   size_t bufsize = 128;
@@ -907,7 +4749,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
   buf[0] = '\0';
   while (1) {
     editorSetStatusMessage(prompt, buf);
-    editorRefreshScreen();
+    E.redraw = 1;
     int c = editorReadKey();
     if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
       if (buflen != 0) buf[--buflen] = '\0';
@@ -935,16 +4777,51 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 }
 
 
+// Reads the text of a bracketed paste, up to the \x1b[201~ that ends it,
+// straight out of the input buffer. Gives up waiting after a while in case the
+// end never comes. Returns a malloc'd buffer and sets *len.
+char *editorReadPaste(int *len) {
+  int cap = KILO_INPUT_BUF;
+  int n = 0;
+  int waits = 0;
+  char *buf = malloc(cap);
+  while (waits < KILO_PASTE_WAIT) {
+    if (!editorInputPending()) {
+      if (editorFillInput(KILO_KEY_WAIT) == 0) waits++;
+      continue;
+    }
+    waits = 0;
+    int avail = input.len - input.pos;
+    if (n + avail > cap) {
+      while (n + avail > cap) cap *= 2;
+      buf = realloc(buf, cap);
+    }
+    memcpy(&buf[n], &input.b[input.pos], avail);
+    // the marker may have started in the previous chunk
+    int from = (n > 5) ? n - 5 : 0;
+    char *end = memmem(&buf[from], n + avail - from, "\x1b[201~", 6);
+    if (end) {
+      input.pos += end + 6 - &buf[n];
+      n = end - buf;
+      break;
+    }
+    input.pos += avail;
+    n += avail;
+  }
+  *len = n;
+  return buf;
+}
+
 // Moves cursor based on arrow key input
 void editorMoveCursor(int key) {
-  erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  erow *row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
   switch (key) {
     case ARROW_LEFT:
       if (E.cx != 0) {
         E.cx--;
       } else if (E.cy > 0) {
         E.cy--;
-        E.cx = E.row[E.cy].size;
+        E.cx = editorRowPeek(E.cy)->size;
       }
       break;
     case ARROW_RIGHT:
@@ -963,7 +4840,7 @@ void editorMoveCursor(int key) {
       break;
   }
 
-  row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
   int rowlen = row ? row->size : 0;
   if (E.cx > rowlen) E.cx = rowlen;
 }
@@ -973,18 +4850,24 @@ void editorProcessKeypress(void) {
   static int quit_times = KILO_QUIT_TIMES;
 
   int c = editorReadKey();
+  long t = profBegin();
   switch (c) {
     case '\r':
       editorInsertNewline();
       break;
     case CTRL_KEY('x'):
+      editorSaveWait();
       if (E.dirty && quit_times > 0) {
         editorSetStatusMessage("WARNING!!! File has unsaved changes. Press Ctrl-X %d more times to quit.", quit_times);
         quit_times--;
+        prof.key = profEnd(t, "editorProcessKeypress", "key", c);
         return;
       }
       write(STDOUT_FILENO, "\x1b[2J", 4);
       write(STDOUT_FILENO, "\x1b[H", 3);
+      if (E.stats)  // how much the screen updates cost
+        fprintf(stderr, "%ld frames, %ld bytes, %ld bytes/frame, last %ld\r\n",
+          E.frames, E.outbytes, E.frames ? E.outbytes / E.frames : 0, E.framebytes);
       exit(0);
       break;
 
@@ -992,13 +4875,22 @@ void editorProcessKeypress(void) {
       editorSave();
       break;
 
+    case PASTE_START:
+      {
+        int len;
+        char *text = editorReadPaste(&len);
+        editorInsertText(text, len);
+        free(text);
+      }
+      break;
+
     case HOME_KEY:
       E.cx = 0;
       break;
 
     case END_KEY:
       if (E.cy < E.numrows)
-        E.cx = E.row[E.cy].size;
+        E.cx = editorRowPeek(E.cy)->size;
       break;
 
 
@@ -1006,6 +4898,10 @@ void editorProcessKeypress(void) {
       editorFind();
       break;
 
+    case CTRL_KEY('p'):
+      profToggleOverlay();
+      break;
+
 
 
     case BACKSPACE:
@@ -1039,6 +4935,7 @@ void editorProcessKeypress(void) {
 
     case CTRL_KEY('l'):
     case '\x1b':
+    case PASTE_END:
       break;
 
     default:
@@ -1046,6 +4943,7 @@ void editorProcessKeypress(void) {
       break;
   }
   quit_times = KILO_QUIT_TIMES;
+  prof.key = profEnd(t, "editorProcessKeypress", "key", c);
 }
 
 /*** prompt (used for save as and other user text input) ***/
@@ -1095,12 +4993,40 @@ void initEditor(void) {
   E.rowoff = 0;
   E.coloff = 0;
   E.numrows = 0;
-  E.row = NULL;
+  E.rowroot = rowNodeNew(1);
+  E.rowleaf = NULL;
+  E.lineoff = NULL;
+  E.gaprow = NULL;
+  E.map = NULL;
+  E.mapsize = 0;
+  E.mapfd = -1;
   E.filename = NULL;
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
+  E.redraw = 1;
+  E.lastframe = 0;
   E.dirty = 0;
   E.syntax = NULL;
+  E.hlvalid = 0;
+  E.hldirty = INT_MAX;
+  E.nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (E.nthreads < 1) E.nthreads = 1;
+  E.longline = getenv("KILO_LONG_LINE") ? atoi(getenv("KILO_LONG_LINE")) : ROW_LONG_LINE;
+  if (E.longline < ROW_TAB_INDEX) E.longline = ROW_TAB_INDEX;  // long rows need a tab index
+  E.frame.c = E.screen.c = NULL;
+  E.frame.attr = E.screen.attr = NULL;
+  E.framecells = 0;
+  editorScanSelect();
+  editorScreenInit();
+  E.screenvalid = 0;
+  E.framebytes = E.outbytes = E.frames = 0;
+  E.stats = getenv("KILO_STATS") != NULL;
+  profInit();
+  E.recordfd = -1;
+  if (getenv("KILO_RECORD")) {
+    E.recordfd = open(getenv("KILO_RECORD"), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (E.recordfd == -1) die("KILO_RECORD");
+  }
 
   if (getWindowSize(&E.screenrows, &E.screencols) == -1)
     die("getWindowSize");
@@ -1109,10 +5035,13 @@ void initEditor(void) {
 
 /*** main ***/
 
+// Benchmarks include this file with KILO_NO_MAIN defined to drive it directly
+#ifndef KILO_NO_MAIN
 // Program entry point
 int main(int argc, char *argv[]) {
   enableRawMode();
   initEditor();
+  editorEventInit();
 
   if (argc >= 2)
     editorOpen(argv[1]);
@@ -1122,9 +5051,13 @@ int main(int argc, char *argv[]) {
     "HELP: Ctrl-S = save | Ctrl-X = quit | Ctrl-Y = find");
 
   while (1) {
-    editorRefreshScreen();
+    // frames are drawn while waiting for keys; between keys that arrived
+    // together only the view follows the cursor
+    editorScroll();
     editorProcessKeypress();
+    E.redraw = 1;
   }
 
   return 0;
 }
+#endif